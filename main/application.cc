@@ -9,6 +9,7 @@
 #include "mcp_server.h"
 #include "assets.h"
 #include "settings.h"
+#include "latency_tracer.h"
 
 #include <cstring>
 #include <esp_log.h>
@@ -73,17 +74,28 @@ void Application::Initialize() {
     auto codec = board.GetAudioCodec();
     audio_service_.Initialize(codec);
     audio_service_.Start();
+    audio_sender_.Start([this]() {
+        return audio_service_.PopPacketFromSendQueue();
+    }, CONFIG_AUDIO_SEND_DEADLINE_MS);
 
     AudioServiceCallbacks callbacks;
     callbacks.on_send_queue_available = [this]() {
-        xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
+        audio_sender_.Notify();
     };
     callbacks.on_wake_word_detected = [this](const std::string& wake_word) {
+        LatencyTracer::GetInstance().Record(kLatencyWakeWord);
         xEventGroupSetBits(event_group_, MAIN_EVENT_WAKE_WORD_DETECTED);
     };
     callbacks.on_vad_change = [this](bool speaking) {
+        if (!speaking) {
+            LatencyTracer::GetInstance().Record(kLatencyVoiceEnd);
+        }
         xEventGroupSetBits(event_group_, MAIN_EVENT_VAD_CHANGE);
     };
+    callbacks.on_end_of_speech = [this]() {
+        // Same as a manual stop, the reply arrives as usual
+        xEventGroupSetBits(event_group_, MAIN_EVENT_STOP_LISTENING);
+    };
     audio_service_.SetCallbacks(callbacks);
 
     // Add state change listeners
@@ -169,7 +181,6 @@ void Application::Run() {
 
     const EventBits_t ALL_EVENTS = 
         MAIN_EVENT_SCHEDULE |
-        MAIN_EVENT_SEND_AUDIO |
         MAIN_EVENT_WAKE_WORD_DETECTED |
         MAIN_EVENT_VAD_CHANGE |
         MAIN_EVENT_CLOCK_TICK |
@@ -218,14 +229,6 @@ void Application::Run() {
             HandleStopListeningEvent();
         }
 
-        if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (protocol_ && !protocol_->SendAudio(std::move(packet))) {
-                    break;
-                }
-            }
-        }
-
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
             HandleWakeWordDetectedEvent();
         }
@@ -238,12 +241,7 @@ void Application::Run() {
         }
 
         if (bits & MAIN_EVENT_SCHEDULE) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            auto tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
-                task();
-            }
+            main_tasks_.RunPending();
         }
 
         if (bits & MAIN_EVENT_CLOCK_TICK) {
@@ -255,6 +253,13 @@ void Application::Run() {
             if (clock_ticks_ % 10 == 0) {
                 SystemInfo::PrintHeapStats();
             }
+            if (clock_ticks_ % 60 == 0) {
+                main_tasks_.PrintStatistics();
+            }
+            LatencyTracer::GetInstance().PrintNewTurns();
+            if (protocol_) {
+                protocol_->ReleaseParkedChannel();
+            }
         }
     }
 }
@@ -298,6 +303,8 @@ void Application::HandleNetworkDisconnectedEvent() {
     if (state == kDeviceStateConnecting || state == kDeviceStateListening || state == kDeviceStateSpeaking) {
         ESP_LOGI(TAG, "Closing audio channel due to network disconnection");
         protocol_->CloseAudioChannel();
+    } else if (protocol_) {
+        protocol_->ReleaseParkedChannel(true);
     }
 
     // Update the status bar immediately to show the network state
@@ -382,7 +389,7 @@ void Application::CheckAssetsVersion() {
             snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
             Schedule([display, message = std::string(buffer)]() {
                 display->SetChatMessage("system", message.c_str());
-            });
+            }, kMainTaskUi, "assets_progress");
         });
 
         board.SetPowerSaveLevel(PowerSaveLevel::LOW_POWER);
@@ -492,6 +499,7 @@ void Application::InitializeProtocol() {
         ESP_LOGW(TAG, "No protocol specified in the OTA config, using MQTT");
         protocol_ = std::make_unique<MqttProtocol>();
     }
+    audio_sender_.SetProtocol(protocol_.get());
 
     protocol_->OnConnected([this]() {
         DismissAlert();
@@ -504,7 +512,9 @@ void Application::InitializeProtocol() {
     
     protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
         if (GetDeviceState() == kDeviceStateSpeaking) {
-            audio_service_.PushPacketToDecodeQueue(std::move(packet));
+            if (audio_service_.PushPacketToDecodeQueue(std::move(packet))) {
+                LatencyTracer::GetInstance().Record(kLatencyFirstPacket);
+            }
         }
     });
     
@@ -522,20 +532,21 @@ void Application::InitializeProtocol() {
             auto display = Board::GetInstance().GetDisplay();
             display->SetChatMessage("system", "");
             SetDeviceState(kDeviceStateIdle);
-        });
+        }, kMainTaskState, "channel_closed");
     });
     
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
+    protocol_->OnIncomingControl([this, display](const ControlMessage& message) {
+        switch (message.type) {
+        case kControlMessageTts:
+            if (message.state == kControlStateStart) {
+                LatencyTracer::GetInstance().Record(kLatencyTtsStart);
+                // A new reply, let its audio through right away, before the state change runs
+                audio_service_.ResumePlayback();
                 Schedule([this]() {
                     aborted_ = false;
                     SetDeviceState(kDeviceStateSpeaking);
-                });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
+                }, kMainTaskState, "tts_start");
+            } else if (message.state == kControlStateStop) {
                 Schedule([this]() {
                     if (GetDeviceState() == kDeviceStateSpeaking) {
                         if (listening_mode_ == kListeningModeManualStop) {
@@ -544,32 +555,39 @@ void Application::InitializeProtocol() {
                             SetDeviceState(kDeviceStateListening);
                         }
                     }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (cJSON_IsString(text)) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([display, message = std::string(text->valuestring)]() {
-                        display->SetChatMessage("assistant", message.c_str());
-                    });
-                }
+                }, kMainTaskState, "tts_stop");
+            } else if (message.state == kControlStateSentenceStart && message.has_text) {
+                ESP_LOGI(TAG, "<< %s", message.full_text());
+                Schedule([display, text = std::string(message.full_text())]() {
+                    display->SetChatMessage("assistant", text.c_str());
+                }, kMainTaskUi, "tts_text");
             }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (cJSON_IsString(text)) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([display, message = std::string(text->valuestring)]() {
-                    display->SetChatMessage("user", message.c_str());
-                });
+            break;
+        case kControlMessageStt:
+            LatencyTracer::GetInstance().Record(kLatencyStt);
+            if (message.has_text) {
+                ESP_LOGI(TAG, ">> %s", message.full_text());
+                Schedule([display, text = std::string(message.full_text())]() {
+                    display->SetChatMessage("user", text.c_str());
+                }, kMainTaskUi, "stt_text");
             }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(emotion)) {
-                Schedule([display, emotion_str = std::string(emotion->valuestring)]() {
-                    display->SetEmotion(emotion_str.c_str());
-                });
+            break;
+        case kControlMessageLlm:
+            if (message.has_emotion) {
+                Schedule([display, emotion = std::string(message.emotion)]() {
+                    display->SetEmotion(emotion.c_str());
+                }, kMainTaskUi, "emotion");
             }
-        } else if (strcmp(type->valuestring, "mcp") == 0) {
+            break;
+        default:
+            break;
+        }
+    });
+
+    protocol_->OnIncomingJson([this, display](const cJSON* root) {
+        // Parse JSON data
+        auto type = cJSON_GetObjectItem(root, "type");
+        if (strcmp(type->valuestring, "mcp") == 0) {
             auto payload = cJSON_GetObjectItem(root, "payload");
             if (cJSON_IsObject(payload)) {
                 McpServer::GetInstance().ParseMessage(payload);
@@ -582,7 +600,7 @@ void Application::InitializeProtocol() {
                     // Do a reboot if user requests a OTA update
                     Schedule([this]() {
                         Reboot();
-                    });
+                    }, kMainTaskState, "reboot");
                 } else {
                     ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
                 }
@@ -603,7 +621,7 @@ void Application::InitializeProtocol() {
             if (cJSON_IsObject(payload)) {
                 Schedule([this, display, payload_str = std::string(cJSON_PrintUnformatted(payload))]() {
                     display->SetChatMessage("system", payload_str.c_str());
-                });
+                }, kMainTaskUi, "custom_message");
             } else {
                 ESP_LOGW(TAG, "Invalid custom message format: missing payload");
             }
@@ -706,14 +724,14 @@ void Application::HandleToggleChatEvent() {
             // Schedule to let the state change be processed first (UI update)
             Schedule([this, mode]() {
                 ContinueOpenAudioChannel(mode);
-            });
+            }, kMainTaskState, "open_channel");
             return;
         }
         SetListeningMode(mode);
     } else if (state == kDeviceStateSpeaking) {
         AbortSpeaking(kAbortReasonNone);
     } else if (state == kDeviceStateListening) {
-        protocol_->CloseAudioChannel();
+        protocol_->ParkAudioChannel();
     }
 }
 
@@ -724,6 +742,8 @@ void Application::ContinueOpenAudioChannel(ListeningMode mode) {
     }
 
     if (!protocol_->IsAudioChannelOpened()) {
+        LatencyTracer::GetInstance().Record(kLatencyChannelOpen);
+        audio_service_.ConfigureEncoderForSession();
         if (!protocol_->OpenAudioChannel()) {
             return;
         }
@@ -755,7 +775,7 @@ void Application::HandleStartListeningEvent() {
             // Schedule to let the state change be processed first (UI update)
             Schedule([this]() {
                 ContinueOpenAudioChannel(kListeningModeManualStop);
-            });
+            }, kMainTaskState, "open_channel");
             return;
         }
         SetListeningMode(kListeningModeManualStop);
@@ -797,7 +817,7 @@ void Application::HandleWakeWordDetectedEvent() {
             // then continue with OpenAudioChannel which may block for ~1 second
             Schedule([this, wake_word]() {
                 ContinueWakeWordInvoke(wake_word);
-            });
+            }, kMainTaskState, "wake_word_invoke");
             return;
         }
         // Channel already opened, continue directly
@@ -817,6 +837,8 @@ void Application::ContinueWakeWordInvoke(const std::string& wake_word) {
     }
 
     if (!protocol_->IsAudioChannelOpened()) {
+        LatencyTracer::GetInstance().Record(kLatencyChannelOpen);
+        audio_service_.ConfigureEncoderForSession();
         if (!protocol_->OpenAudioChannel()) {
             audio_service_.EnableWakeWordDetection(true);
             return;
@@ -827,14 +849,14 @@ void Application::ContinueWakeWordInvoke(const std::string& wake_word) {
 #if CONFIG_SEND_WAKE_WORD_DATA
     // Encode and send the wake word data to the server
     while (auto packet = audio_service_.PopWakeWordPacket()) {
-        protocol_->SendAudio(std::move(packet));
+        audio_sender_.Send(std::move(packet));
     }
     // Set the chat state to wake word detected
     protocol_->SendWakeWordDetected(wake_word);
     SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
 #else
-    // Set flag to play popup sound after state changes to listening
-    // (PlaySound here would be cleared by ResetDecoder in EnableVoiceProcessing)
+    // Set flag to play popup sound after state changes to listening, so the auto stop
+    // mode does not wait for it to finish before listening starts
     play_popup_on_listening_ = true;
     SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
 #endif
@@ -877,11 +899,14 @@ void Application::HandleStateChangedEvent() {
                 
                 // Send the start listening command
                 protocol_->SendStartListening(listening_mode_);
+                audio_service_.EnableEndpointing(listening_mode_ == kListeningModeAutoStop);
                 audio_service_.EnableVoiceProcessing(true);
-                audio_service_.EnableWakeWordDetection(false);
+                // A wake word sharing the AFE costs nothing extra, keep it for barge-in in realtime mode
+                audio_service_.EnableWakeWordDetection(audio_service_.IsWakeWordSharingFrontEnd() &&
+                    listening_mode_ == kListeningModeRealtime);
             }
 
-            // Play popup sound after ResetDecoder (in EnableVoiceProcessing) has been called
+            // Sounds are mixed over any speech, ResetDecoder does not cut them
             if (play_popup_on_listening_) {
                 play_popup_on_listening_ = false;
                 audio_service_.PlaySound(Lang::Sounds::OGG_POPUP);
@@ -907,17 +932,16 @@ void Application::HandleStateChangedEvent() {
     }
 }
 
-void Application::Schedule(std::function<void()>&& callback) {
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
-    }
+void Application::Schedule(MainTask&& callback, MainTaskPriority priority, const char* name) {
+    main_tasks_.Push(std::move(callback), priority, name);
     xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
 }
 
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+    // Silence the speaker now, the server may keep sending for a round trip
+    audio_service_.AbortPlayback();
     if (protocol_) {
         protocol_->SendAbortSpeaking(reason);
     }
@@ -933,7 +957,10 @@ void Application::Reboot() {
     // Disconnect the audio channel
     if (protocol_ && protocol_->IsAudioChannelOpened()) {
         protocol_->CloseAudioChannel();
+    } else if (protocol_) {
+        protocol_->ReleaseParkedChannel(true);
     }
+    audio_sender_.SetProtocol(nullptr);
     protocol_.reset();
     audio_service_.Stop();
 
@@ -952,6 +979,8 @@ bool Application::UpgradeFirmware(const std::string& url, const std::string& ver
     if (protocol_ && protocol_->IsAudioChannelOpened()) {
         ESP_LOGI(TAG, "Closing audio channel before firmware upgrade");
         protocol_->CloseAudioChannel();
+    } else if (protocol_) {
+        protocol_->ReleaseParkedChannel(true);
     }
     ESP_LOGI(TAG, "Starting firmware upgrade from URL: %s", upgrade_url.c_str());
 
@@ -972,7 +1001,7 @@ bool Application::UpgradeFirmware(const std::string& url, const std::string& ver
         snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
         Schedule([display, message = std::string(buffer)]() {
             display->SetChatMessage("system", message.c_str());
-        });
+        }, kMainTaskUi, "upgrade_progress");
     });
 
     if (!upgrade_success) {
@@ -1008,7 +1037,7 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
             // Schedule to let the state change be processed first (UI update)
             Schedule([this, wake_word]() {
                 ContinueWakeWordInvoke(wake_word);
-            });
+            }, kMainTaskState, "wake_word_invoke");
             return;
         }
         // Channel already opened, continue directly
@@ -1016,13 +1045,13 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
     } else if (state == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
-        });
+        }, kMainTaskAudio, "abort_speaking");
     } else if (state == kDeviceStateListening) {   
         Schedule([this]() {
             if (protocol_) {
-                protocol_->CloseAudioChannel();
+                protocol_->ParkAudioChannel();
             }
-        });
+        }, kMainTaskAudio, "park_channel");
     }
 }
 
@@ -1049,7 +1078,15 @@ void Application::SendMcpMessage(const std::string& payload) {
         if (protocol_) {
             protocol_->SendMcpMessage(payload);
         }
-    });
+    }, kMainTaskBackground, "mcp_message");
+}
+
+void Application::SendMcpMessage(std::shared_ptr<TextSource> payload) {
+    Schedule([this, payload = std::move(payload)]() mutable {
+        if (protocol_) {
+            protocol_->SendMcpMessage(std::move(payload));
+        }
+    }, kMainTaskBackground, "mcp_message");
 }
 
 void Application::SetAecMode(AecMode mode) {
@@ -1075,8 +1112,10 @@ void Application::SetAecMode(AecMode mode) {
         // If the AEC mode is changed, close the audio channel
         if (protocol_ && protocol_->IsAudioChannelOpened()) {
             protocol_->CloseAudioChannel();
+        } else if (protocol_) {
+            protocol_->ReleaseParkedChannel(true);
         }
-    });
+    }, kMainTaskAudio, "aec_mode");
 }
 
 void Application::PlaySound(const std::string_view& sound) {
@@ -1090,7 +1129,8 @@ void Application::ResetProtocol() {
             protocol_->CloseAudioChannel();
         }
         // Reset protocol
+        audio_sender_.SetProtocol(nullptr);
         protocol_.reset();
-    });
+    }, kMainTaskState, "reset_protocol");
 }
 
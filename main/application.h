@@ -14,12 +14,13 @@
 #include "protocol.h"
 #include "ota.h"
 #include "audio_service.h"
+#include "audio_sender.h"
 #include "device_state.h"
 #include "device_state_machine.h"
+#include "main_task_queue.h"
 
 // Main event bits
 #define MAIN_EVENT_SCHEDULE             (1 << 0)
-#define MAIN_EVENT_SEND_AUDIO           (1 << 1)
 #define MAIN_EVENT_WAKE_WORD_DETECTED   (1 << 2)
 #define MAIN_EVENT_VAD_CHANGE           (1 << 3)
 #define MAIN_EVENT_ERROR                (1 << 4)
@@ -75,8 +76,9 @@ public:
 
     /**
      * Schedule a callback to be executed in the main task
+     * Higher priorities run first, name identifies the task in over-budget warnings
      */
-    void Schedule(std::function<void()>&& callback);
+    void Schedule(MainTask&& callback, MainTaskPriority priority = kMainTaskUi, const char* name = nullptr);
 
     /**
      * Alert with status, message, emotion and optional sound
@@ -109,6 +111,7 @@ public:
     bool UpgradeFirmware(const std::string& url, const std::string& version = "");
     bool CanEnterSleepMode();
     void SendMcpMessage(const std::string& payload);
+    void SendMcpMessage(std::shared_ptr<TextSource> payload);
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
     void PlaySound(const std::string_view& sound);
@@ -125,8 +128,7 @@ private:
     Application();
     ~Application();
 
-    std::mutex mutex_;
-    std::deque<std::function<void()>> main_tasks_;
+    MainTaskQueue main_tasks_;
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
     esp_timer_handle_t clock_timer_handle_ = nullptr;
@@ -135,6 +137,7 @@ private:
     AecMode aec_mode_ = kAecOff;
     std::string last_error_message_;
     AudioService audio_service_;
+    AudioSender audio_sender_;
     std::unique_ptr<Ota> ota_;
 
     bool has_server_time_ = false;
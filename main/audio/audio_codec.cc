@@ -18,6 +18,30 @@ void AudioCodec::OutputData(std::vector<int16_t>& data) {
     Write(data.data(), data.size());
 }
 
+void AudioCodec::FlushOutput() {
+    if (tx_handle_ == nullptr || !output_enabled_) {
+        return;
+    }
+    /*
+     * A TX channel paired with RX on the same port shares its clock with the microphone, stopping
+     * it would glitch the input and the AEC reference. Let the few DMA buffers play out instead.
+     */
+    i2s_chan_info_t info;
+    if (i2s_channel_get_info(tx_handle_, &info) != ESP_OK || info.pair_chan != nullptr) {
+        return;
+    }
+    /* Restart the simplex channel with silence preloaded, whatever the DMA still held is never played */
+    static const uint8_t silence[256] = {};
+    ESP_ERROR_CHECK_WITHOUT_ABORT(i2s_channel_disable(tx_handle_));
+    size_t loaded = 0;
+    do {
+        if (i2s_channel_preload_data(tx_handle_, silence, sizeof(silence), &loaded) != ESP_OK) {
+            break;
+        }
+    } while (loaded == sizeof(silence));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(i2s_channel_enable(tx_handle_));
+}
+
 bool AudioCodec::InputData(std::vector<int16_t>& data) {
     int samples = Read(data.data(), data.size());
     if (samples > 0) {
@@ -25,6 +25,8 @@ public:
     virtual void EnableOutput(bool enable);
 
     virtual void OutputData(std::vector<int16_t>& data);
+    // Drops the samples still queued in a simplex output DMA, called from the task that writes the output
+    virtual void FlushOutput();
     virtual bool InputData(std::vector<int16_t>& data);
     virtual void Start();
 
@@ -0,0 +1,164 @@
+#ifndef AUDIO_FRAME_POOL_H
+#define AUDIO_FRAME_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#define AUDIO_POOL_MAX_PCM_BUFFERS 8
+#define AUDIO_POOL_MAX_OPUS_BUFFERS 48
+#define AUDIO_POOL_PACKET_SLOTS 64
+#define AUDIO_POOL_TASK_SLOTS 8
+#define AUDIO_POOL_SLOT_SIZE 64
+
+struct AudioFramePoolStatistics {
+    uint32_t pcm_hits = 0;
+    uint32_t pcm_misses = 0;
+    uint32_t opus_hits = 0;
+    uint32_t opus_misses = 0;
+    uint32_t object_hits = 0;
+    uint32_t object_misses = 0;
+};
+
+/*
+ * Recycles std::vector buffers so their capacity is reused frame after frame.
+ * The pool starts empty and fills up with the buffers released during the first frames,
+ * after that the audio pipeline runs without touching the heap.
+ */
+template <typename T, size_t MaxBuffers>
+class AudioBufferPool {
+public:
+    std::vector<T> Acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (count_ == 0) {
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return std::vector<T>();
+        }
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        return std::move(buffers_[--count_]);
+    }
+
+    void Release(std::vector<T>&& buffer) {
+        if (buffer.capacity() == 0) {
+            return;
+        }
+        buffer.clear();
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (count_ < MaxBuffers) {
+            buffers_[count_++] = std::move(buffer);
+            return;
+        }
+        lock.unlock();
+        // Pool is full, let the buffer go back to the heap outside the lock
+        std::vector<T> dropped = std::move(buffer);
+    }
+
+    uint32_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint32_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+    std::mutex mutex_;
+    std::atomic<uint32_t> hits_{0};
+    std::atomic<uint32_t> misses_{0};
+    std::vector<T> buffers_[MaxBuffers];
+    size_t count_ = 0;
+};
+
+/*
+ * Fixed-size blocks in a static arena for the small packet / task objects.
+ * Falls back to the heap when the arena is exhausted.
+ */
+template <size_t Slots>
+class AudioObjectSlab {
+public:
+    AudioObjectSlab() {
+        for (size_t i = 0; i < Slots; i++) {
+            free_list_[i] = Slots - 1 - i;
+        }
+        free_count_ = Slots;
+    }
+
+    void* Allocate(size_t size) {
+        if (size <= AUDIO_POOL_SLOT_SIZE) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_count_ > 0) {
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return arena_[free_list_[--free_count_]].data;
+            }
+        }
+        // Counted outside the lock, the counters are atomic
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(size);
+    }
+
+    void Free(void* ptr) {
+        auto block = static_cast<Block*>(ptr);
+        if (block >= arena_ && block < arena_ + Slots) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_list_[free_count_++] = block - arena_;
+            return;
+        }
+        ::operator delete(ptr);
+    }
+
+    uint32_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint32_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+    struct Block {
+        alignas(std::max_align_t) uint8_t data[AUDIO_POOL_SLOT_SIZE];
+    };
+
+    std::mutex mutex_;
+    std::atomic<uint32_t> hits_{0};
+    std::atomic<uint32_t> misses_{0};
+    Block arena_[Slots];
+    uint16_t free_list_[Slots];
+    size_t free_count_ = 0;
+};
+
+class AudioFramePool {
+public:
+    static AudioFramePool& GetInstance() {
+        static AudioFramePool instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    AudioFramePool(const AudioFramePool&) = delete;
+    AudioFramePool& operator=(const AudioFramePool&) = delete;
+
+    std::vector<int16_t> AcquirePcm() { return pcm_pool_.Acquire(); }
+    void ReleasePcm(std::vector<int16_t>&& pcm) { pcm_pool_.Release(std::move(pcm)); }
+    std::vector<uint8_t> AcquireOpus() { return opus_pool_.Acquire(); }
+    void ReleaseOpus(std::vector<uint8_t>&& opus) { opus_pool_.Release(std::move(opus)); }
+
+    void* AllocatePacket(size_t size) { return packet_slab_.Allocate(size); }
+    void FreePacket(void* ptr) { packet_slab_.Free(ptr); }
+    void* AllocateTask(size_t size) { return task_slab_.Allocate(size); }
+    void FreeTask(void* ptr) { task_slab_.Free(ptr); }
+
+    // Each pool and slab counts on its own, this is a snapshot of all of them
+    AudioFramePoolStatistics statistics() const {
+        AudioFramePoolStatistics statistics;
+        statistics.pcm_hits = pcm_pool_.hits();
+        statistics.pcm_misses = pcm_pool_.misses();
+        statistics.opus_hits = opus_pool_.hits();
+        statistics.opus_misses = opus_pool_.misses();
+        statistics.object_hits = packet_slab_.hits() + task_slab_.hits();
+        statistics.object_misses = packet_slab_.misses() + task_slab_.misses();
+        return statistics;
+    }
+
+private:
+    AudioFramePool() = default;
+    ~AudioFramePool() = default;
+
+    AudioBufferPool<int16_t, AUDIO_POOL_MAX_PCM_BUFFERS> pcm_pool_;
+    AudioBufferPool<uint8_t, AUDIO_POOL_MAX_OPUS_BUFFERS> opus_pool_;
+    AudioObjectSlab<AUDIO_POOL_PACKET_SLOTS> packet_slab_;
+    AudioObjectSlab<AUDIO_POOL_TASK_SLOTS> task_slab_;
+};
+
+#endif // AUDIO_FRAME_POOL_H
@@ -0,0 +1,93 @@
+#include "audio_mixer.h"
+#include "audio_service.h"
+#include "pcm_kernels.h"
+
+#include <algorithm>
+
+static int32_t PercentToFactor(int percent) {
+    return std::min(100, std::max(0, percent)) * PCM_VOLUME_UNITY / 100;
+}
+
+AudioMixer::AudioMixer() : duck_gain_(PercentToFactor(AUDIO_MIXER_DUCK_PERCENT)) {
+    for (auto& voice : voices_) {
+        voice.gain = PCM_VOLUME_UNITY;
+    }
+}
+
+AudioMixer::~AudioMixer() = default;
+
+void AudioMixer::SetSource(AudioVoice voice, Source source) {
+    voices_[voice].source = std::move(source);
+}
+
+void AudioMixer::SetGain(AudioVoice voice, int percent) {
+    voices_[voice].gain = PercentToFactor(percent);
+}
+
+void AudioMixer::SetDuckGain(int percent) {
+    duck_gain_ = PercentToFactor(percent);
+}
+
+bool AudioMixer::Fill(Voice& voice) {
+    while (voice.task == nullptr || voice.offset >= voice.task->pcm.size()) {
+        voice.task.reset();
+        voice.offset = 0;
+        if (!voice.source) {
+            return false;
+        }
+        voice.task = voice.source();
+        if (voice.task == nullptr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::unique_ptr<AudioTask> AudioMixer::Mix(bool& has_speech) {
+    auto& speech = voices_[kAudioVoiceSpeech];
+    auto& cue = voices_[kAudioVoiceCue];
+    has_speech = Fill(speech);
+    bool has_cue = Fill(cue);
+    busy_ = has_speech || has_cue;
+    if (!busy_) {
+        return nullptr;
+    }
+
+    std::unique_ptr<AudioTask> out;
+    if (!has_speech) {
+        /* The cue alone, from where the last speech frame left it */
+        if (cue.offset == 0) {
+            out = std::move(cue.task);
+        } else {
+            out = std::make_unique<AudioTask>();
+            out->type = kAudioTaskTypeDecodeToPlaybackQueue;
+            out->pcm = AudioFramePool::GetInstance().AcquirePcm();
+            out->pcm.assign(cue.task->pcm.begin() + cue.offset, cue.task->pcm.end());
+            cue.task.reset();
+        }
+        cue.offset = 0;
+        if (cue.gain != PCM_VOLUME_UNITY) {
+            PcmScale16(out->pcm.data(), out->pcm.size(), cue.gain);
+        }
+        return out;
+    }
+
+    out = std::move(speech.task);
+    speech.offset = 0;
+    int32_t gain = speech.gain;
+    if (has_cue) {
+        gain = (int64_t)gain * duck_gain_ / PCM_VOLUME_UNITY;
+    }
+    if (gain != PCM_VOLUME_UNITY) {
+        PcmScale16(out->pcm.data(), out->pcm.size(), gain);
+    }
+
+    size_t mixed = 0;
+    while (has_cue && mixed < out->pcm.size() && Fill(cue)) {
+        size_t count = std::min(out->pcm.size() - mixed, cue.task->pcm.size() - cue.offset);
+        PcmMix16(out->pcm.data() + mixed, cue.task->pcm.data() + cue.offset, count, cue.gain);
+        mixed += count;
+        cue.offset += count;
+    }
+    return out;
+}
@@ -0,0 +1,60 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+struct AudioTask;
+
+enum AudioVoice {
+    kAudioVoiceSpeech,  // Server audio and the audio testing replay
+    kAudioVoiceCue,     // Built-in sounds from PlaySound
+    kAudioVoiceCount,
+};
+
+// Speech level while a cue plays, in percent of its own gain
+#define AUDIO_MIXER_DUCK_PERCENT 40
+
+/*
+ * Mixes the decoded voices in front of the codec, all at the codec output sample rate.
+ * Speech frames go out whole and keep their timestamp, a cue is added to them sample by
+ * sample and may span several frames. Without speech the cue frames go out on their own.
+ *
+ * Mix() runs on the output task only. Gains may be changed from any task.
+ */
+class AudioMixer {
+public:
+    using Source = std::function<std::unique_ptr<AudioTask>()>;
+
+    AudioMixer();
+    ~AudioMixer();
+
+    // Called by Mix() for the next decoded frame of a voice, returns nullptr when none is ready
+    void SetSource(AudioVoice voice, Source source);
+    void SetGain(AudioVoice voice, int percent);
+    void SetDuckGain(int percent);
+
+    // Next frame for the codec, nullptr when every voice is silent
+    std::unique_ptr<AudioTask> Mix(bool& has_speech);
+    // A voice still holds samples that were not played
+    bool Busy() const { return busy_; }
+
+private:
+    struct Voice {
+        Source source;
+        std::unique_ptr<AudioTask> task;
+        size_t offset = 0;
+        std::atomic<int32_t> gain;
+    };
+    Voice voices_[kAudioVoiceCount];
+    std::atomic<int32_t> duck_gain_;
+    std::atomic<bool> busy_ = false;
+
+    // Makes sure the voice has samples left, pulling its next frame if needed
+    bool Fill(Voice& voice);
+};
+
+#endif // AUDIO_MIXER_H
@@ -1,5 +1,8 @@
 #include "audio_service.h"
+#include "latency_tracer.h"
+#include "pcm_kernels.h"
 #include <esp_log.h>
+#include <algorithm>
 #include <cstring>
 
 #define RATE_CVT_CFG(_src_rate, _dest_rate, _channel)        \
@@ -13,15 +16,6 @@
         .perf_type       = ESP_AE_RATE_CVT_PERF_TYPE_SPEED,  \
     }
 
-#define OPUS_DEC_CFG(_sample_rate, _frame_duration_ms)                                                    \
-    (esp_opus_dec_cfg_t)                                                                                  \
-    {                                                                                                     \
-        .sample_rate    = (uint32_t)(_sample_rate),                                                       \
-        .channel        = ESP_AUDIO_MONO,                                                                 \
-        .frame_duration = (esp_opus_dec_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(_frame_duration_ms),  \
-        .self_delimited = false,                                                                          \
-    }
-
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
 #else
@@ -31,14 +25,46 @@
 #if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
 #include "wake_words/afe_wake_word.h"
 #include "wake_words/custom_wake_word.h"
+#if CONFIG_USE_SHARED_AFE_FRONT_END
+#include "wake_words/shared_afe_wake_word.h"
+#endif
 #else
 #include "wake_words/esp_wake_word.h"
 #endif
 
+#if CONFIG_USE_AUDIO_CODEC_BENCHMARK
+#include "codec_benchmark.h"
+#endif
+
+#if defined(CONFIG_OPUS_ENCODE_TASK_CORE) && CONFIG_OPUS_ENCODE_TASK_CORE >= 0
+#define OPUS_ENCODE_TASK_CORE CONFIG_OPUS_ENCODE_TASK_CORE
+#else
+#define OPUS_ENCODE_TASK_CORE tskNO_AFFINITY
+#endif
+#if defined(CONFIG_OPUS_DECODE_TASK_CORE) && CONFIG_OPUS_DECODE_TASK_CORE >= 0
+#define OPUS_DECODE_TASK_CORE CONFIG_OPUS_DECODE_TASK_CORE
+#else
+#define OPUS_DECODE_TASK_CORE tskNO_AFFINITY
+#endif
+#define OPUS_ENCODE_TASK_PRIORITY CONFIG_OPUS_ENCODE_TASK_PRIORITY
+#define OPUS_DECODE_TASK_PRIORITY CONFIG_OPUS_DECODE_TASK_PRIORITY
+
 #define TAG "AudioService"
 
 AudioService::AudioService() {
     event_group_ = xEventGroupCreate();
+    xEventGroupSetBits(event_group_, AS_EVENT_PLAYBACK_IDLE);
+
+    mixer_.SetSource(kAudioVoiceSpeech, [this]() {
+        std::unique_ptr<AudioTask> task;
+        audio_playback_queue_.Pop(task);
+        return task;
+    });
+    mixer_.SetSource(kAudioVoiceCue, [this]() {
+        std::unique_ptr<AudioTask> task;
+        audio_cue_playback_queue_.Pop(task);
+        return task;
+    });
 }
 
 AudioService::~AudioService() {
@@ -48,40 +74,20 @@ AudioService::~AudioService() {
     if (opus_encoder_ != nullptr) {
         esp_opus_enc_close(opus_encoder_);
     }
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_close(opus_decoder_);
-    }
     if (input_resampler_ != nullptr) {
         esp_ae_rate_cvt_close(input_resampler_);
     }
-    if (output_resampler_ != nullptr) {
-        esp_ae_rate_cvt_close(output_resampler_);
-    }
+    // The decoders and output resamplers are owned by decoder_cache_
 }
 
 void AudioService::Initialize(AudioCodec* codec) {
     codec_ = codec;
     codec_->Start();
 
-    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
-    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &opus_decoder_);
-    if (opus_decoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
-    } else {
-        decoder_sample_rate_ = codec->output_sample_rate();
-        decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
-        decoder_frame_size_ = decoder_sample_rate_ / 1000 * OPUS_FRAME_DURATION_MS;
-    }
-    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
-    ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &opus_encoder_);
-    if (opus_encoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
-    } else {
-        encoder_sample_rate_ = 16000;
-        encoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
-        esp_opus_enc_get_frame_size(opus_encoder_, &encoder_frame_size_, &encoder_outbuf_size_);
-        encoder_frame_size_ = encoder_frame_size_ / sizeof(int16_t);
-    }
+    decoder_cache_.SetOutputSampleRate(codec->output_sample_rate());
+    cue_decoder_cache_.SetOutputSampleRate(codec->output_sample_rate());
+    SetDecodeSampleRate(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
+    OpenEncoder(encoder_controller_.params());
 
     if (codec->input_sample_rate() != 16000) {
         esp_ae_rate_cvt_cfg_t input_resampler_cfg = RATE_CVT_CFG(
@@ -92,16 +98,23 @@ void AudioService::Initialize(AudioCodec* codec) {
         }
     }
 
-#if CONFIG_USE_AUDIO_PROCESSOR
+#if CONFIG_USE_SHARED_AFE_FRONT_END
+    audio_processor_ = std::make_unique<AfeAudioProcessor>(true);
+#elif CONFIG_USE_AUDIO_PROCESSOR
     audio_processor_ = std::make_unique<AfeAudioProcessor>();
 #else
     audio_processor_ = std::make_unique<NoAudioProcessor>();
 #endif
 
     audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
-        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
+        PushUplinkFrame(std::move(data));
     });
 
+#if CONFIG_USE_VOICE_ENDPOINTING
+    endpointer_ = std::make_unique<VoiceEndpointer>(CONFIG_ENDPOINT_MIN_SPEECH_MS, CONFIG_ENDPOINT_END_SILENCE_MS,
+        CONFIG_ENDPOINT_PRE_ROLL_MS, CONFIG_ENDPOINT_NO_SPEECH_TIMEOUT_MS);
+#endif
+
     audio_processor_->OnVadStateChange([this](bool speaking) {
         voice_detected_ = speaking;
         if (callbacks_.on_vad_change) {
@@ -158,12 +171,25 @@ void AudioService::Start() {
     }, "audio_output", 2048, this, 4, &audio_output_task_handle_);
 #endif
 
-    /* Start the opus codec task */
-    xTaskCreate([](void* arg) {
+    /* Start the opus encoder and decoder tasks, so a slow encode never stalls playback */
+    xTaskCreatePinnedToCore([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
-        audio_service->OpusCodecTask();
+        audio_service->OpusEncodeTask();
         vTaskDelete(NULL);
-    }, "opus_codec", 2048 * 12, this, 2, &opus_codec_task_handle_);
+    }, "opus_encode", 2048 * 12, this, OPUS_ENCODE_TASK_PRIORITY, &opus_encode_task_handle_, OPUS_ENCODE_TASK_CORE);
+
+    xTaskCreatePinnedToCore([](void* arg) {
+        AudioService* audio_service = (AudioService*)arg;
+        audio_service->OpusDecodeTask();
+        vTaskDelete(NULL);
+    }, "opus_decode", 2048 * 6, this, OPUS_DECODE_TASK_PRIORITY, &opus_decode_task_handle_, OPUS_DECODE_TASK_CORE);
+
+    audio_playback_queue_.SetConsumer(audio_output_task_handle_);
+    audio_cue_playback_queue_.SetConsumer(audio_output_task_handle_);
+    audio_decode_queue_.SetConsumer(opus_decode_task_handle_);
+    audio_cue_queue_.SetConsumer(opus_decode_task_handle_);
+    audio_testing_queue_.SetConsumer(opus_decode_task_handle_);
+    audio_encode_queue_.SetConsumer(opus_encode_task_handle_);
 }
 
 void AudioService::Stop() {
@@ -173,12 +199,35 @@ void AudioService::Stop() {
         AS_EVENT_WAKE_WORD_RUNNING |
         AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    xEventGroupSetBits(event_group_, AS_EVENT_PLAYBACK_IDLE);
+
+    audio_encode_queue_.Clear();
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_cue_queue_.Clear();
+    audio_cue_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+    NotifyAudioTasks();
+
+    /* The tasks exit on their own, stop notifying them from the rings */
+    audio_playback_queue_.SetConsumer(nullptr);
+    audio_cue_playback_queue_.SetConsumer(nullptr);
+    audio_decode_queue_.SetConsumer(nullptr);
+    audio_cue_queue_.SetConsumer(nullptr);
+    audio_encode_queue_.SetConsumer(nullptr);
+    audio_testing_queue_.SetConsumer(nullptr);
+}
+
+void AudioService::NotifyAudioTasks() {
+    if (audio_output_task_handle_ != nullptr) {
+        xTaskNotifyGive(audio_output_task_handle_);
+    }
+    if (opus_encode_task_handle_ != nullptr) {
+        xTaskNotifyGive(opus_encode_task_handle_);
+    }
+    if (opus_decode_task_handle_ != nullptr) {
+        xTaskNotifyGive(opus_decode_task_handle_);
+    }
 }
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
@@ -198,12 +247,14 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
             uint32_t in_sample_num = data.size() / codec_->input_channels();
             uint32_t output_samples = 0;
             esp_ae_rate_cvt_get_max_out_sample_num(input_resampler_, in_sample_num, &output_samples);
-            auto resampled = std::vector<int16_t>(output_samples * codec_->input_channels());
+            auto resampled = AudioFramePool::GetInstance().AcquirePcm();
+            resampled.resize(output_samples * codec_->input_channels());
             uint32_t actual_output = output_samples;
             esp_ae_rate_cvt_process(input_resampler_, (esp_ae_sample_t)data.data(), in_sample_num,
                                    (esp_ae_sample_t)resampled.data(), &actual_output);
             resampled.resize(actual_output * codec_->input_channels());
-            data = std::move(resampled);
+            data.swap(resampled);
+            AudioFramePool::GetInstance().ReleasePcm(std::move(resampled));
         }
     } else {
         data.resize(samples * codec_->input_channels());
@@ -227,50 +278,91 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
     return true;
 }
 
+bool AudioService::ReadInputStream(std::vector<int16_t>& data, int samples) {
+    /*
+     * The microphone is read in fixed blocks and the remainder is kept for the next call, so
+     * consumers with different feed sizes can take turns without losing or repeating samples
+     * and the input resampler never sees a change of block size.
+     */
+    size_t needed = samples * codec_->input_channels();
+    size_t block = AUDIO_INPUT_BLOCK_MS * 16 * codec_->input_channels();
+    if (needed + block > input_ring_.size()) {
+        ESP_LOGE(TAG, "Input feed of %u samples does not fit the input ring", (unsigned)needed);
+        return false;
+    }
+    while (input_ring_size_ < needed) {
+        if (!ReadAudioData(data, 16000, AUDIO_INPUT_BLOCK_MS * 16)) {
+            return false;
+        }
+        size_t write = (input_ring_read_ + input_ring_size_) % input_ring_.size();
+        size_t first = std::min(data.size(), input_ring_.size() - write);
+        memcpy(input_ring_.data() + write, data.data(), first * sizeof(int16_t));
+        memcpy(input_ring_.data(), data.data() + first, (data.size() - first) * sizeof(int16_t));
+        input_ring_size_ += data.size();
+    }
+    data.resize(needed);
+    size_t first = std::min(needed, input_ring_.size() - input_ring_read_);
+    memcpy(data.data(), input_ring_.data() + input_ring_read_, first * sizeof(int16_t));
+    memcpy(data.data() + first, input_ring_.data(), (needed - first) * sizeof(int16_t));
+    input_ring_read_ = (input_ring_read_ + needed) % input_ring_.size();
+    input_ring_size_ -= needed;
+    return true;
+}
+
 void AudioService::AudioInputTask() {
+    auto& pool = AudioFramePool::GetInstance();
+    /* Reused across iterations, refilled from the pool whenever a consumer keeps the buffer */
+    std::vector<int16_t> data;
+    input_ring_.resize(AUDIO_INPUT_RING_SAMPLES);
+    const EventBits_t input_bits = AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING |
+        AS_EVENT_AUDIO_PROCESSOR_RUNNING;
+
     while (true) {
-        EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
-            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING,
-            pdFALSE, pdFALSE, portMAX_DELAY);
+        if ((xEventGroupGetBits(event_group_) & input_bits) == 0) {
+            /* Nobody reads the input: the stream restarts with the next consumer */
+            input_ring_read_ = 0;
+            input_ring_size_ = 0;
+            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
+            if (input_resampler_ != nullptr) {
+                esp_ae_rate_cvt_reset(input_resampler_);
+            }
+        }
+        EventBits_t bits = xEventGroupWaitBits(event_group_, input_bits, pdFALSE, pdFALSE, portMAX_DELAY);
 
         if (service_stopped_) {
             break;
         }
-        if (audio_input_need_warmup_) {
-            audio_input_need_warmup_ = false;
-            vTaskDelay(pdMS_TO_TICKS(120));
-            continue;
-        }
 
         /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
         if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
-            if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
+            if (audio_testing_queue_.Full()) {
                 ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
                 EnableAudioTesting(false);
                 continue;
             }
-            std::vector<int16_t> data;
-            int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
-            if (ReadAudioData(data, 16000, samples)) {
+            if (data.capacity() == 0) {
+                data = pool.AcquirePcm();
+            }
+            int samples = encoder_duration_ms_ * 16000 / 1000;
+            if (ReadInputStream(data, samples)) {
                 // If input channels is 2, we need to fetch the left channel data
                 if (codec_->input_channels() == 2) {
-                    auto mono_data = std::vector<int16_t>(data.size() / 2);
-                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                        mono_data[i] = data[j];
-                    }
-                    data = std::move(mono_data);
+                    data.resize(PcmExtractChannel(data.data(), data.data(), data.size() / 2, 2));
                 }
                 PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
+                data = std::vector<int16_t>();
                 continue;
             }
         }
 
         /* Feed the wake word */
         if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-            std::vector<int16_t> data;
+            if (data.capacity() == 0) {
+                data = pool.AcquirePcm();
+            }
             int samples = wake_word_->GetFeedSize();
             if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
+                if (ReadInputStream(data, samples)) {
                     wake_word_->Feed(data);
                     continue;
                 }
@@ -279,10 +371,13 @@ void AudioService::AudioInputTask() {
 
         /* Feed the audio processor */
         if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
-            std::vector<int16_t> data;
+            if (data.capacity() == 0) {
+                data = pool.AcquirePcm();
+            }
             int samples = audio_processor_->GetFeedSize();
             if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
+                if (ReadInputStream(data, samples)) {
+                    /* AfeAudioProcessor only reads the buffer, NoAudioProcessor may take it */
                     audio_processor_->Feed(std::move(data));
                     continue;
                 }
@@ -293,21 +388,27 @@ void AudioService::AudioInputTask() {
         break;
     }
 
+    pool.ReleasePcm(std::move(data));
     ESP_LOGW(TAG, "Audio input task stopped");
 }
 
 void AudioService::AudioOutputTask() {
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
         if (service_stopped_) {
             break;
         }
 
-        auto task = std::move(audio_playback_queue_.front());
-        audio_playback_queue_.pop_front();
-        audio_queue_cv_.notify_all();
-        lock.unlock();
+        if (playback_abort_pending_.exchange(false)) {
+            FadeOutAbortedPlayback();
+        }
+
+        bool has_speech = false;
+        auto task = mixer_.Mix(has_speech);
+        if (!task) {
+            UpdatePlaybackIdleState();
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
 
         if (!codec_->output_enabled()) {
             esp_timer_stop(audio_power_timer_);
@@ -315,6 +416,9 @@ void AudioService::AudioOutputTask() {
             codec_->EnableOutput(true);
         }
         codec_->OutputData(task->pcm);
+        if (has_speech) {
+            LatencyTracer::GetInstance().Record(kLatencyFirstOutput);
+        }
 
         /* Update the last output time */
         last_output_time_ = std::chrono::steady_clock::now();
@@ -323,7 +427,7 @@ void AudioService::AudioOutputTask() {
 #if CONFIG_USE_SERVER_AEC
         /* Record the timestamp for server AEC */
         if (task->timestamp > 0) {
-            lock.lock();
+            std::lock_guard<std::mutex> lock(timestamp_mutex_);
             timestamp_queue_.push_back(task->timestamp);
         }
 #endif
@@ -332,207 +436,437 @@ void AudioService::AudioOutputTask() {
     ESP_LOGW(TAG, "Audio output task stopped");
 }
 
-void AudioService::OpusCodecTask() {
+void AudioService::OpusDecodeTask() {
+#if CONFIG_USE_AUDIO_CODEC_BENCHMARK
+    CodecBenchmark benchmark("Opus decode");
+#endif
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
-            return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
         if (service_stopped_) {
             break;
         }
+        if (jitter_buffer_reset_.exchange(false)) {
+            jitter_buffer_.Reset();
+        }
+
+        /* Move everything that arrived into the jitter buffer, so arrival times are measured now */
+        std::unique_ptr<AudioStreamPacket> packet;
+        while (!jitter_buffer_.Full() && audio_decode_queue_.Pop(packet)) {
+            jitter_buffer_.Push(std::move(packet), esp_timer_get_time());
+        }
+
+        /* Built-in sounds have their own decoder and never wait behind the server audio */
+        DecodeCues();
+
+        /* Decode from the jitter buffer, then replay the testing queue if requested */
+        JitterBufferAction action = kJitterBufferWait;
+        TickType_t wait_ticks = portMAX_DELAY;
+        if (!audio_playback_queue_.Full()) {
+            int wait_ms = -1;
+            decoding_ = true;
+            action = jitter_buffer_.Pop(esp_timer_get_time(), packet, wait_ms);
+            if (action == kJitterBufferWait) {
+                if (wait_ms >= 0) {
+                    wait_ticks = pdMS_TO_TICKS(wait_ms) + 1;
+                } else if (audio_testing_replay_) {
+                    if (audio_testing_queue_.Pop(packet)) {
+                        action = kJitterBufferPlay;
+                    } else {
+                        audio_testing_replay_ = false;
+                    }
+                }
+            }
+        }
+        if (action == kJitterBufferWait) {
+            decoding_ = false;
+            UpdatePlaybackIdleState();
+            /* Ask the output task to wake us when it frees a playback slot, retry if it just did */
+            bool playback_blocked = !audio_playback_queue_.Full() || audio_playback_queue_.ArmProducerWakeup();
+            bool cue_blocked = audio_cue_queue_.Empty() || audio_cue_playback_queue_.ArmProducerWakeup();
+            if (!playback_blocked || !cue_blocked) {
+                continue;
+            }
+            ulTaskNotifyTake(pdTRUE, wait_ticks);
+            continue;
+        }
 
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
+        /* A lost frame is rebuilt from the FEC data of the next packet if it is here, else by PLC */
+        const AudioStreamPacket* source = packet.get();
+        esp_audio_dec_recovery_t recovery = ESP_AUDIO_DEC_RECOVERY_NONE;
+        if (action == kJitterBufferConceal) {
+            source = jitter_buffer_.Peek();
+            recovery = source != nullptr ? ESP_AUDIO_DEC_RECOVERY_FEC : ESP_AUDIO_DEC_RECOVERY_PLC;
+        }
 
-            auto task = std::make_unique<AudioTask>();
-            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
-            task->timestamp = packet->timestamp;
+        auto task = std::make_unique<AudioTask>();
+        task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+        task->pcm = AudioFramePool::GetInstance().AcquirePcm();
+        task->timestamp = packet ? packet->timestamp : 0;
 
+        if (packet) {
             SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_ != nullptr) {
-                task->pcm.resize(decoder_frame_size_);
-                esp_audio_dec_in_raw_t raw = {
-                    .buffer = (uint8_t *)(packet->payload.data()),
-                    .len = (uint32_t)(packet->payload.size()),
-                    .consumed = 0,
-                    .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
-                };
-                esp_audio_dec_out_frame_t out_frame = {
-                    .buffer = (uint8_t *)(task->pcm.data()),
-                    .len = (uint32_t)(task->pcm.size() * sizeof(int16_t)),
-                    .decoded_size = 0,
-                };
-                esp_audio_dec_info_t dec_info = {};
-                std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-                auto ret = esp_opus_dec_decode(opus_decoder_, &raw, &out_frame, &dec_info);
-                decoder_lock.unlock();
-                if (ret == ESP_AUDIO_ERR_OK) {
-                    task->pcm.resize(out_frame.decoded_size / sizeof(int16_t));
-                    if (decoder_sample_rate_ != codec_->output_sample_rate() && output_resampler_ != nullptr) {
-                        uint32_t target_size = 0;
-                        esp_ae_rate_cvt_get_max_out_sample_num(output_resampler_, task->pcm.size(), &target_size);
-                        std::vector<int16_t> resampled(target_size);
-                        uint32_t actual_output = target_size;
-                        esp_ae_rate_cvt_process(output_resampler_, (esp_ae_sample_t)task->pcm.data(), task->pcm.size(),
-                                                (esp_ae_sample_t)resampled.data(), &actual_output);
-                        resampled.resize(actual_output);
-                        task->pcm = std::move(resampled);
-                    }
-                    lock.lock();
-                    audio_playback_queue_.push_back(std::move(task));
-                    audio_queue_cv_.notify_all();
-                    debug_statistics_.decode_count++;
-                } else {
-                    ESP_LOGE(TAG, "Failed to decode audio after resize, error code: %d", ret);
-                    lock.lock();
+        }
+        if (opus_decoder_ != nullptr) {
+            task->pcm.resize(decoder_frame_size_);
+            esp_audio_dec_in_raw_t raw = {
+                .buffer = source != nullptr ? (uint8_t *)(source->opus_data()) : nullptr,
+                .len = source != nullptr ? (uint32_t)(source->opus_size()) : 0,
+                .consumed = 0,
+                .frame_recover = recovery,
+            };
+            esp_audio_dec_out_frame_t out_frame = {
+                .buffer = (uint8_t *)(task->pcm.data()),
+                .len = (uint32_t)(task->pcm.size() * sizeof(int16_t)),
+                .decoded_size = 0,
+            };
+            esp_audio_dec_info_t dec_info = {};
+#if CONFIG_USE_AUDIO_CODEC_BENCHMARK
+            int64_t start_time = esp_timer_get_time();
+#endif
+            std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
+            auto ret = esp_opus_dec_decode(opus_decoder_, &raw, &out_frame, &dec_info);
+            decoder_lock.unlock();
+#if CONFIG_USE_AUDIO_CODEC_BENCHMARK
+            benchmark.Record(esp_timer_get_time() - start_time, decoder_duration_ms_);
+#endif
+            if (ret == ESP_AUDIO_ERR_OK) {
+                task->pcm.resize(out_frame.decoded_size / sizeof(int16_t));
+                if (decoder_sample_rate_ != codec_->output_sample_rate() && output_resampler_ != nullptr) {
+                    ResampleOutput(output_resampler_, task->pcm);
+                }
+                /* Only this task produces to the playback queue, and we checked it is not full */
+                if (!playback_aborted_) {
+                    audio_playback_queue_.Push(std::move(task));
                 }
+                debug_statistics_.decode_count++;
             } else {
-                ESP_LOGE(TAG, "Audio decoder is not configured");
-                lock.lock();
+                ESP_LOGE(TAG, "Failed to decode audio after resize, error code: %d", ret);
             }
-            debug_statistics_.decode_count++;
-        }
-        /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
-            auto task = std::move(audio_encode_queue_.front());
-            audio_encode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->frame_duration = OPUS_FRAME_DURATION_MS;
-            packet->sample_rate = 16000;
-            packet->timestamp = task->timestamp;
-
-            if (opus_encoder_ != nullptr && task->pcm.size() == encoder_frame_size_) {
-                std::vector<uint8_t> buf(encoder_outbuf_size_);
-                esp_audio_enc_in_frame_t in = {
-                    .buffer = (uint8_t *)(task->pcm.data()),
-                    .len = (uint32_t)(encoder_frame_size_ * sizeof(int16_t)),
-                };
-                esp_audio_enc_out_frame_t out = {
-                    .buffer = buf.data(),
-                    .len = (uint32_t)encoder_outbuf_size_,
-                    .encoded_bytes = 0,
-                };
-                auto ret = esp_opus_enc_process(opus_encoder_, &in, &out);
-                if (ret == ESP_AUDIO_ERR_OK) {
-                    packet->payload.assign(buf.data(), buf.data() + out.encoded_bytes);
-
-                    if (task->type == kAudioTaskTypeEncodeToSendQueue) {
-                        {
-                            std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
-                            audio_send_queue_.push_back(std::move(packet));
-                        }
-                        if (callbacks_.on_send_queue_available) {
-                            callbacks_.on_send_queue_available();
-                        }
-                    } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
-                        std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
-                        audio_testing_queue_.push_back(std::move(packet));
+        } else {
+            ESP_LOGE(TAG, "Audio decoder is not configured");
+        }
+        decoding_ = false;
+        UpdatePlaybackIdleState();
+        debug_statistics_.decode_count++;
+    }
+
+    audio_playback_queue_.DisarmProducerWakeup();
+    audio_cue_playback_queue_.DisarmProducerWakeup();
+    ESP_LOGW(TAG, "Opus decode task stopped");
+}
+
+void AudioService::DecodeCues() {
+    std::unique_ptr<AudioStreamPacket> packet;
+    while (!audio_cue_playback_queue_.Full() && audio_cue_queue_.Pop(packet)) {
+        decoding_ = true;
+        if (cue_decoder_ == nullptr || cue_decoder_->sample_rate != packet->sample_rate ||
+            cue_decoder_->frame_duration != packet->frame_duration) {
+            cue_decoder_ = cue_decoder_cache_.Acquire(packet->sample_rate, packet->frame_duration);
+            if (cue_decoder_ == nullptr) {
+                continue;
+            }
+        }
+
+        /* Read through a const packet, so sounds referenced in flash are not copied */
+        const AudioStreamPacket* source = packet.get();
+        auto task = std::make_unique<AudioTask>();
+        task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+        task->pcm = AudioFramePool::GetInstance().AcquirePcm();
+        task->pcm.resize(packet->sample_rate / 1000 * packet->frame_duration);
+        esp_audio_dec_in_raw_t raw = {
+            .buffer = (uint8_t *)(source->opus_data()),
+            .len = (uint32_t)(source->opus_size()),
+            .consumed = 0,
+            .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
+        };
+        esp_audio_dec_out_frame_t out_frame = {
+            .buffer = (uint8_t *)(task->pcm.data()),
+            .len = (uint32_t)(task->pcm.size() * sizeof(int16_t)),
+            .decoded_size = 0,
+        };
+        esp_audio_dec_info_t dec_info = {};
+        auto ret = esp_opus_dec_decode(cue_decoder_->decoder, &raw, &out_frame, &dec_info);
+        if (ret != ESP_AUDIO_ERR_OK) {
+            ESP_LOGE(TAG, "Failed to decode sound, error code: %d", ret);
+            continue;
+        }
+        task->pcm.resize(out_frame.decoded_size / sizeof(int16_t));
+        if (cue_decoder_->resampler != nullptr) {
+            ResampleOutput(cue_decoder_->resampler, task->pcm);
+        }
+        /* Only this task produces to the cue playback queue, and we checked it is not full */
+        audio_cue_playback_queue_.Push(std::move(task));
+    }
+}
+
+void AudioService::ResampleOutput(esp_ae_rate_cvt_handle_t resampler, std::vector<int16_t>& pcm) {
+    uint32_t target_size = 0;
+    esp_ae_rate_cvt_get_max_out_sample_num(resampler, pcm.size(), &target_size);
+    auto resampled = AudioFramePool::GetInstance().AcquirePcm();
+    resampled.resize(target_size);
+    uint32_t actual_output = target_size;
+    esp_ae_rate_cvt_process(resampler, (esp_ae_sample_t)pcm.data(), pcm.size(),
+                            (esp_ae_sample_t)resampled.data(), &actual_output);
+    resampled.resize(actual_output);
+    pcm.swap(resampled);
+    AudioFramePool::GetInstance().ReleasePcm(std::move(resampled));
+}
+
+void AudioService::OpusEncodeTask() {
+#if CONFIG_USE_AUDIO_CODEC_BENCHMARK
+    CodecBenchmark benchmark("Opus encode");
+#endif
+    while (true) {
+        if (service_stopped_) {
+            break;
+        }
+
+        /* Back-pressure from the network only stalls the encoder, never playback */
+        std::unique_ptr<AudioTask> task;
+        if (audio_send_queue_.Full() || !audio_encode_queue_.Pop(task)) {
+            if (audio_send_queue_.Full() && !audio_send_queue_.ArmProducerWakeup()) {
+                continue;
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        /* Held while encoding, ConfigureEncoderForSession may reopen the encoder */
+        std::unique_lock<std::mutex> encoder_lock(encoder_mutex_);
+        auto packet = std::make_unique<AudioStreamPacket>();
+        packet->frame_duration = encoder_duration_ms_;
+        packet->sample_rate = 16000;
+        packet->timestamp = task->timestamp;
+
+        if (opus_encoder_ != nullptr && task->pcm.size() == encoder_frame_size_) {
+            /* Encode straight into the pooled payload buffer, behind room for the transport header */
+            packet->headroom = AUDIO_PACKET_HEADROOM;
+            packet->ResizeOpus(encoder_outbuf_size_);
+            esp_audio_enc_in_frame_t in = {
+                .buffer = (uint8_t *)(task->pcm.data()),
+                .len = (uint32_t)(encoder_frame_size_ * sizeof(int16_t)),
+            };
+            esp_audio_enc_out_frame_t out = {
+                .buffer = packet->opus_data(),
+                .len = (uint32_t)encoder_outbuf_size_,
+                .encoded_bytes = 0,
+            };
+#if CONFIG_USE_AUDIO_CODEC_BENCHMARK
+            int64_t start_time = esp_timer_get_time();
+#endif
+            auto ret = esp_opus_enc_process(opus_encoder_, &in, &out);
+#if CONFIG_USE_AUDIO_CODEC_BENCHMARK
+            benchmark.Record(esp_timer_get_time() - start_time, encoder_duration_ms_);
+#endif
+            if (ret == ESP_AUDIO_ERR_OK) {
+                packet->ResizeOpus(out.encoded_bytes);
+
+                if (task->type == kAudioTaskTypeEncodeToSendQueue) {
+                    audio_send_queue_.Push(std::move(packet));
+                    LatencyTracer::GetInstance().Record(kLatencyFirstUplink);
+                    /* Lower the bitrate while the uplink backs up, raise it once it drains */
+                    int bitrate = 0;
+                    if (encoder_controller_.OnFrameQueued(audio_send_queue_.Size(), bitrate)) {
+                        esp_opus_enc_set_bitrate(opus_encoder_, bitrate);
+                    }
+                    encoder_lock.unlock();
+                    if (callbacks_.on_send_queue_available) {
+                        callbacks_.on_send_queue_available();
+                    }
+                } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
+                    if (!audio_testing_queue_.Push(std::move(packet))) {
+                        ESP_LOGW(TAG, "Audio testing queue is full, dropping packet");
                     }
-                    debug_statistics_.encode_count++;
-                } else {
-                    ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
                 }
+                debug_statistics_.encode_count++;
             } else {
-                ESP_LOGE(TAG, "Failed to encode audio: encoder not configured or invalid frame size (got %u, expected %u)",
-                         task->pcm.size(), encoder_frame_size_);
+                ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
             }
-            lock.lock();
+        } else {
+            ESP_LOGE(TAG, "Failed to encode audio: encoder not configured or invalid frame size (got %u, expected %u)",
+                     task->pcm.size(), encoder_frame_size_);
         }
     }
 
-    ESP_LOGW(TAG, "Opus codec task stopped");
+    audio_send_queue_.DisarmProducerWakeup();
+    ESP_LOGW(TAG, "Opus encode task stopped");
 }
 
 void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
     if (decoder_sample_rate_ == sample_rate && decoder_duration_ms_ == frame_duration) {
         return;
     }
-    std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_close(opus_decoder_);
+    /* Switching formats is a pointer swap once both formats have been used */
+    std::lock_guard<std::mutex> decoder_lock(decoder_mutex_);
+    auto slot = decoder_cache_.Acquire(sample_rate, frame_duration);
+    if (slot == nullptr) {
         opus_decoder_ = nullptr;
-    }
-    decoder_lock.unlock();
-    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(sample_rate, frame_duration);
-    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &opus_decoder_);
-    if (opus_decoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
+        output_resampler_ = nullptr;
+        decoder_sample_rate_ = 0;
         return;
     }
+    opus_decoder_ = slot->decoder;
+    output_resampler_ = slot->resampler;
     decoder_sample_rate_ = sample_rate;
     decoder_duration_ms_ = frame_duration;
     decoder_frame_size_ = decoder_sample_rate_ / 1000 * frame_duration;
+}
+
+bool AudioService::OpenEncoder(const OpusEncoderParams& params) {
+    std::lock_guard<std::mutex> lock(encoder_mutex_);
+    if (opus_encoder_ != nullptr) {
+        esp_opus_enc_close(opus_encoder_);
+        opus_encoder_ = nullptr;
+    }
+    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
+    opus_enc_cfg.frame_duration = (esp_opus_enc_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(params.frame_duration_ms);
+    opus_enc_cfg.bitrate = params.bitrate > 0 ? params.bitrate : ESP_OPUS_BITRATE_AUTO;
+    opus_enc_cfg.enable_fec = params.enable_fec;
+    auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &opus_encoder_);
+    if (opus_encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+        return false;
+    }
+    encoder_sample_rate_ = 16000;
+    encoder_duration_ms_ = params.frame_duration_ms;
+    esp_opus_enc_get_frame_size(opus_encoder_, &encoder_frame_size_, &encoder_outbuf_size_);
+    encoder_frame_size_ = encoder_frame_size_ / sizeof(int16_t);
+    encoder_fec_enabled_ = params.enable_fec;
+    return true;
+}
 
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (decoder_sample_rate_ != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", decoder_sample_rate_, codec->output_sample_rate());
-        if (output_resampler_ != nullptr) {
-            esp_ae_rate_cvt_close(output_resampler_);
-            output_resampler_ = nullptr;
+int AudioService::ConfigureEncoderForSession() {
+    auto params = encoder_controller_.NegotiateSession();
+    if (params.frame_duration_ms != encoder_duration_ms_ || params.enable_fec != encoder_fec_enabled_) {
+        /* Frames queued with the old size are dropped by the encode task */
+        OpenEncoder(params);
+    } else if (params.bitrate > 0) {
+        std::lock_guard<std::mutex> lock(encoder_mutex_);
+        if (opus_encoder_ != nullptr) {
+            esp_opus_enc_set_bitrate(opus_encoder_, params.bitrate);
         }
-        esp_ae_rate_cvt_cfg_t output_resampler_cfg = RATE_CVT_CFG(
-            decoder_sample_rate_, codec->output_sample_rate(), ESP_AUDIO_MONO);
-        auto resampler_ret = esp_ae_rate_cvt_open(&output_resampler_cfg, &output_resampler_);
-        if (output_resampler_ == nullptr) {
-            ESP_LOGE(TAG, "Failed to create output resampler, error code: %d", resampler_ret);
+    }
+    return encoder_duration_ms_;
+}
+
+void AudioService::ReportNetworkRtt(int rtt_ms) {
+    encoder_controller_.ReportRtt(rtt_ms);
+}
+
+void AudioService::ClearEndpointPreRoll() {
+    auto& pool = AudioFramePool::GetInstance();
+    for (auto& frame : endpoint_pre_roll_) {
+        pool.ReleasePcm(std::move(frame));
+    }
+    endpoint_pre_roll_.clear();
+}
+
+void AudioService::PushUplinkFrame(std::vector<int16_t>&& pcm) {
+    if (endpointer_reset_.exchange(false)) {
+        endpointer_->Reset();
+        ClearEndpointPreRoll();
+    }
+    if (!endpointing_enabled_) {
+        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(pcm));
+        return;
+    }
+
+    int frame_ms = pcm.size() / 16;
+    switch (endpointer_->Process(voice_detected_, frame_ms)) {
+    case kEndpointHold:
+        endpoint_pre_roll_.push_back(std::move(pcm));
+        while ((int)endpoint_pre_roll_.size() * frame_ms > endpointer_->pre_roll_ms()) {
+            AudioFramePool::GetInstance().ReleasePcm(std::move(endpoint_pre_roll_.front()));
+            endpoint_pre_roll_.pop_front();
+            debug_statistics_.endpoint_dropped++;
+        }
+        break;
+    case kEndpointSend:
+        /* Speech onset: the held frames go first, so the first syllable is not clipped */
+        while (!endpoint_pre_roll_.empty()) {
+            PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(endpoint_pre_roll_.front()));
+            endpoint_pre_roll_.pop_front();
+        }
+        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(pcm));
+        break;
+    case kEndpointEnd:
+        if (endpointer_->speech_ms() > 0) {
+            ESP_LOGI(TAG, "End of speech after %d ms of speech", endpointer_->speech_ms());
+            PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(pcm));
+        } else {
+            ESP_LOGI(TAG, "No speech before the timeout");
+            AudioFramePool::GetInstance().ReleasePcm(std::move(pcm));
+            debug_statistics_.endpoint_dropped++;
+        }
+        ClearEndpointPreRoll();
+        if (callbacks_.on_end_of_speech) {
+            callbacks_.on_end_of_speech();
         }
+        break;
+    case kEndpointDrop:
+        AudioFramePool::GetInstance().ReleasePcm(std::move(pcm));
+        debug_statistics_.endpoint_dropped++;
+        break;
     }
 }
 
+void AudioService::EnableEndpointing(bool enable) {
+    if (endpointer_ == nullptr) {
+        return;
+    }
+    ESP_LOGD(TAG, "%s endpointing", enable ? "Enabling" : "Disabling");
+    /* Applied by the processor output with its next frame */
+    endpointer_reset_ = true;
+    endpointing_enabled_ = enable;
+}
+
 void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm) {
     auto task = std::make_unique<AudioTask>();
     task->type = type;
     task->pcm = std::move(pcm);
-    /* Push the task to the encode queue */
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
 
     /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        std::lock_guard<std::mutex> lock(timestamp_mutex_);
+        if (!timestamp_queue_.empty()) {
+            if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
+                task->timestamp = timestamp_queue_.front();
+            } else {
+                ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+            }
+            timestamp_queue_.pop_front();
         }
-        timestamp_queue_.pop_front();
     }
 
-    audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
-    audio_encode_queue_.push_back(std::move(task));
-    audio_queue_cv_.notify_all();
+    /* Push the task to the encode queue, waiting for the opus encode task to free a slot */
+    std::unique_lock<std::mutex> lock(encode_producer_mutex_);
+    while (!audio_encode_queue_.Push(std::move(task))) {
+        if (service_stopped_) {
+            return;
+        }
+        audio_encode_queue_.WaitForSpace(pdMS_TO_TICKS(AUDIO_QUEUE_WAIT_MS));
+    }
 }
 
 bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
-        if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
+    /* Late packets of an aborted reply */
+    if (playback_aborted_) {
+        debug_statistics_.abort_dropped++;
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(decode_producer_mutex_);
+    while (!audio_decode_queue_.Push(std::move(packet))) {
+        if (!wait || service_stopped_) {
             return false;
         }
+        audio_decode_queue_.WaitForSpace(pdMS_TO_TICKS(AUDIO_QUEUE_WAIT_MS));
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
+    xEventGroupClearBits(event_group_, AS_EVENT_PLAYBACK_IDLE);
     return true;
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    if (audio_send_queue_.empty()) {
-        return nullptr;
-    }
-    auto packet = std::move(audio_send_queue_.front());
-    audio_send_queue_.pop_front();
-    audio_queue_cv_.notify_all();
+    std::unique_ptr<AudioStreamPacket> packet;
+    audio_send_queue_.Pop(packet);
     return packet;
 }
 
@@ -549,6 +883,7 @@ const std::string& AudioService::GetLastWakeWord() const {
 std::unique_ptr<AudioStreamPacket> AudioService::PopWakeWordPacket() {
     auto packet = std::make_unique<AudioStreamPacket>();
     if (wake_word_->GetWakeWordOpus(packet->payload)) {
+        packet->headroom = AUDIO_PACKET_HEADROOM;
         return packet;
     }
     return nullptr;
@@ -568,14 +903,6 @@ void AudioService::EnableWakeWordDetection(bool enable) {
             }
             wake_word_initialized_ = true;
         }
-        // Reset input resampler to clear cached data from previous mode (e.g. AudioProcessor)
-        // This prevents buffer overflow when switching between different feed sizes
-        {
-            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
-            if (input_resampler_ != nullptr) {
-                esp_ae_rate_cvt_reset(input_resampler_);
-            }
-        }
         wake_word_->Start();
         xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
     } else {
@@ -588,21 +915,15 @@ void AudioService::EnableVoiceProcessing(bool enable) {
     ESP_LOGD(TAG, "%s voice processing", enable ? "Enabling" : "Disabling");
     if (enable) {
         if (!audio_processor_initialized_) {
-            audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
+            audio_processor_->Initialize(codec_, encoder_duration_ms_, models_list_);
             audio_processor_initialized_ = true;
+        } else {
+            /* The session may have negotiated another frame duration */
+            audio_processor_->SetFrameDuration(encoder_duration_ms_);
         }
 
         /* We should make sure no audio is playing */
         ResetDecoder();
-        audio_input_need_warmup_ = true;
-        // Reset input resampler to clear cached data from previous mode (e.g. WakeWord)
-        // This prevents buffer overflow when switching between different feed sizes
-        {
-            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
-            if (input_resampler_ != nullptr) {
-                esp_ae_rate_cvt_reset(input_resampler_);
-            }
-        }
         audio_processor_->Start();
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
     } else {
@@ -617,17 +938,17 @@ void AudioService::EnableAudioTesting(bool enable) {
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
     } else {
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
-        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
-        audio_queue_cv_.notify_all();
+        /* Let the opus decode task play back the recorded testing queue */
+        xEventGroupClearBits(event_group_, AS_EVENT_PLAYBACK_IDLE);
+        audio_testing_replay_ = true;
+        NotifyAudioTasks();
     }
 }
 
 void AudioService::EnableDeviceAec(bool enable) {
     ESP_LOGI(TAG, "%s device AEC", enable ? "Enabling" : "Disabling");
     if (!audio_processor_initialized_) {
-        audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
+        audio_processor_->Initialize(codec_, encoder_duration_ms_, models_list_);
         audio_processor_initialized_ = true;
     }
 
@@ -645,120 +966,118 @@ void AudioService::PlaySound(const std::string_view& ogg) {
         codec_->EnableOutput(true);
     }
 
-    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
-    size_t size = ogg.size();
-    size_t offset = 0;
-
-    auto find_page = [&](size_t start)->size_t {
-        for (size_t i = start; i + 4 <= size; ++i) {
-            if (buf[i] == 'O' && buf[i+1] == 'g' && buf[i+2] == 'g' && buf[i+3] == 'S') return i;
+    /* Built-in sounds are indexed once and played straight from flash */
+    OggSound parsed;
+    const OggSound* sound = sound_index_.Find(ogg);
+    bool in_flash = sound != nullptr;
+    if (!in_flash) {
+        if (!OggSoundIndex::Parse(ogg, parsed)) {
+            ESP_LOGW(TAG, "No Opus stream in sound of %u bytes", (unsigned)ogg.size());
+            return;
         }
-        return static_cast<size_t>(-1);
-    };
-
-    bool seen_head = false;
-    bool seen_tags = false;
-    int sample_rate = 16000; // 默认值
-
-    while (true) {
-        size_t pos = find_page(offset);
-        if (pos == static_cast<size_t>(-1)) break;
-        offset = pos;
-        if (offset + 27 > size) break;
-
-        const uint8_t* page = buf + offset;
-        uint8_t page_segments = page[26];
-        size_t seg_table_off = offset + 27;
-        if (seg_table_off + page_segments > size) break;
-
-        size_t body_size = 0;
-        for (size_t i = 0; i < page_segments; ++i) body_size += page[27 + i];
-
-        size_t body_off = seg_table_off + page_segments;
-        if (body_off + body_size > size) break;
-
-        // Parse packets using lacing
-        size_t cur = body_off;
-        size_t seg_idx = 0;
-        while (seg_idx < page_segments) {
-            size_t pkt_len = 0;
-            size_t pkt_start = cur;
-            bool continued = false;
-            do {
-                uint8_t l = page[27 + seg_idx++];
-                pkt_len += l;
-                cur += l;
-                continued = (l == 255);
-            } while (continued && seg_idx < page_segments);
-
-            if (pkt_len == 0) continue;
-            const uint8_t* pkt_ptr = buf + pkt_start;
-
-            if (!seen_head) {
-                // 解析OpusHead包
-                if (pkt_len >= 19 && std::memcmp(pkt_ptr, "OpusHead", 8) == 0) {
-                    seen_head = true;
-                    // OpusHead结构：[0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip
-                    // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
-                    if (pkt_len >= 12) {
-                        uint8_t version = pkt_ptr[8];
-                        uint8_t channel_count = pkt_ptr[9];
-                        if (pkt_len >= 16) {
-                            // 读取输入采样率 (little-endian)
-                            sample_rate = pkt_ptr[12] | (pkt_ptr[13] << 8) |
-                                        (pkt_ptr[14] << 16) | (pkt_ptr[15] << 24);
-                            ESP_LOGI(TAG, "OpusHead: version=%d, channels=%d, sample_rate=%d",
-                                   version, channel_count, sample_rate);
-                        }
-                    }
-                }
-                continue;
-            }
-            if (!seen_tags) {
-                // Expect OpusTags in second packet
-                if (pkt_len >= 8 && std::memcmp(pkt_ptr, "OpusTags", 8) == 0) {
-                    seen_tags = true;
-                }
-                continue;
-            }
+        sound = &parsed;
+    }
 
-            // Audio packet (Opus)
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->sample_rate = sample_rate;
-            packet->frame_duration = 60;
-            packet->payload.resize(pkt_len);
-            std::memcpy(packet->payload.data(), pkt_ptr, pkt_len);
-            PushPacketToDecodeQueue(std::move(packet), true);
+    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
+    for (const auto& entry : sound->packets) {
+        auto packet = std::make_unique<AudioStreamPacket>();
+        packet->sample_rate = sound->sample_rate;
+        packet->frame_duration = 60;
+        if (in_flash) {
+            packet->Reference(buf + entry.offset, entry.length);
+        } else {
+            packet->payload.assign(buf + entry.offset, buf + entry.offset + entry.length);
         }
+        PushPacketToCueQueue(std::move(packet));
+    }
+}
 
-        offset = body_off + body_size;
+void AudioService::PushPacketToCueQueue(std::unique_ptr<AudioStreamPacket> packet) {
+    std::unique_lock<std::mutex> lock(cue_producer_mutex_);
+    while (!audio_cue_queue_.Push(std::move(packet))) {
+        if (service_stopped_) {
+            return;
+        }
+        audio_cue_queue_.WaitForSpace(pdMS_TO_TICKS(AUDIO_QUEUE_WAIT_MS));
     }
+    xEventGroupClearBits(event_group_, AS_EVENT_PLAYBACK_IDLE);
 }
 
 bool AudioService::IsIdle() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    return audio_encode_queue_.Empty() && audio_decode_queue_.Empty() && audio_playback_queue_.Empty() &&
+        audio_cue_queue_.Empty() && audio_cue_playback_queue_.Empty() && !mixer_.Busy() && audio_testing_queue_.Empty();
 }
 
 void AudioService::WaitForPlaybackQueueEmpty() {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    audio_queue_cv_.wait(lock, [this]() { 
-        return service_stopped_ || (audio_decode_queue_.empty() && audio_playback_queue_.empty()); 
-    });
+    xEventGroupWaitBits(event_group_, AS_EVENT_PLAYBACK_IDLE, pdFALSE, pdFALSE, portMAX_DELAY);
+}
+
+void AudioService::UpdatePlaybackIdleState() {
+    if (!audio_decode_queue_.Empty() || !jitter_buffer_.Empty() || decoding_ || !audio_playback_queue_.Empty() ||
+        !audio_cue_queue_.Empty() || !audio_cue_playback_queue_.Empty() || mixer_.Busy() || audio_testing_replay_) {
+        return;
+    }
+    xEventGroupSetBits(event_group_, AS_EVENT_PLAYBACK_IDLE);
+    /* A producer may have pushed between the check and the set */
+    if (!audio_decode_queue_.Empty() || !jitter_buffer_.Empty() || decoding_ || audio_testing_replay_) {
+        xEventGroupClearBits(event_group_, AS_EVENT_PLAYBACK_IDLE);
+    }
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
     std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
     if (opus_decoder_ != nullptr) {
         esp_opus_dec_reset(opus_decoder_);
     }
     decoder_lock.unlock();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    {
+        std::lock_guard<std::mutex> lock(timestamp_mutex_);
+        timestamp_queue_.clear();
+    }
+    audio_testing_replay_ = false;
+    /* The jitter buffer belongs to the decode task, which drops it on its next loop */
+    jitter_buffer_reset_ = true;
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+    UpdatePlaybackIdleState();
+}
+
+void AudioService::AbortPlayback() {
+    ESP_LOGI(TAG, "Aborting playback");
+    playback_abort_time_us_ = esp_timer_get_time();
+    playback_aborted_ = true;
+    jitter_buffer_reset_ = true;
+    audio_decode_queue_.Clear();
+    playback_abort_pending_ = true;
+    NotifyAudioTasks();
+}
+
+void AudioService::ResumePlayback() {
+    playback_aborted_ = false;
+}
+
+void AudioService::FadeOutAbortedPlayback() {
+    /*
+     * Cut what the DMA still holds, then ramp the next queued frame down to silence, so the
+     * reply stops within a few milliseconds without a click. Sounds on the cue voice go on.
+     */
+    std::unique_ptr<AudioTask> task;
+    audio_playback_queue_.Pop(task);
+    audio_playback_queue_.Clear();
+    codec_->FlushOutput();
+
+    int fade_samples = codec_->output_sample_rate() * AUDIO_ABORT_FADE_MS / 1000;
+    if (task && codec_->output_enabled() && !task->pcm.empty()) {
+        task->pcm.resize(std::min<size_t>(task->pcm.size(), fade_samples));
+        PcmFadeOut16(task->pcm.data(), task->pcm.size());
+        codec_->OutputData(task->pcm);
+    }
+
+    int silence_ms = (esp_timer_get_time() - playback_abort_time_us_) / 1000 + AUDIO_ABORT_FADE_MS;
+    debug_statistics_.abort_to_silence_ms = silence_ms;
+    ESP_LOGI(TAG, "Playback aborted, silent %d ms after the abort", silence_ms);
+    UpdatePlaybackIdleState();
 }
 
 void AudioService::CheckAndUpdateAudioPowerState() {
@@ -776,6 +1095,22 @@ void AudioService::CheckAndUpdateAudioPowerState() {
     }
 }
 
+DebugStatistics AudioService::GetDebugStatistics() const {
+    DebugStatistics statistics = debug_statistics_;
+    auto pool = AudioFramePool::GetInstance().statistics();
+    statistics.pool_hits = pool.pcm_hits + pool.opus_hits + pool.object_hits;
+    statistics.pool_misses = pool.pcm_misses + pool.opus_misses + pool.object_misses;
+    auto jitter = jitter_buffer_.statistics();
+    statistics.jitter_late = jitter.late;
+    statistics.jitter_lost = jitter.lost;
+    statistics.jitter_concealed = jitter.concealed;
+    statistics.jitter_depth = jitter.depth;
+    statistics.jitter_target_depth = jitter.target_depth;
+    statistics.decoder_cache_hits = decoder_cache_.hits();
+    statistics.decoder_cache_misses = decoder_cache_.misses();
+    return statistics;
+}
+
 void AudioService::SetModelsList(srmodel_list_t* models_list) {
     models_list_ = models_list;
 
@@ -783,7 +1118,11 @@ void AudioService::SetModelsList(srmodel_list_t* models_list) {
     if (esp_srmodel_filter(models_list_, ESP_MN_PREFIX, NULL) != nullptr) {
         wake_word_ = std::make_unique<CustomWakeWord>();
     } else if (esp_srmodel_filter(models_list_, ESP_WN_PREFIX, NULL) != nullptr) {
+#if CONFIG_USE_SHARED_AFE_FRONT_END
+        wake_word_ = std::make_unique<SharedAfeWakeWord>(static_cast<AfeAudioProcessor*>(audio_processor_.get()));
+#else
         wake_word_ = std::make_unique<AfeWakeWord>();
+#endif
     } else {
         wake_word_ = nullptr;
     }
@@ -806,8 +1145,21 @@ void AudioService::SetModelsList(srmodel_list_t* models_list) {
 
 bool AudioService::IsAfeWakeWord() {
 #if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
+#if CONFIG_USE_SHARED_AFE_FRONT_END
+    if (IsWakeWordSharingFrontEnd()) {
+        return true;
+    }
+#endif
     return wake_word_ != nullptr && dynamic_cast<AfeWakeWord*>(wake_word_.get()) != nullptr;
 #else
     return false;
 #endif
 }
+
+bool AudioService::IsWakeWordSharingFrontEnd() {
+#if CONFIG_USE_SHARED_AFE_FRONT_END
+    return wake_word_ != nullptr && dynamic_cast<SharedAfeWakeWord*>(wake_word_.get()) != nullptr;
+#else
+    return false;
+#endif
+}
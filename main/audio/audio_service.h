@@ -3,9 +3,9 @@
 
 #include <memory>
 #include <deque>
-#include <condition_variable>
 #include <chrono>
 #include <mutex>
+#include <atomic>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -23,26 +23,48 @@
 #include "processors/audio_debugger.h"
 #include "wake_word.h"
 #include "protocol.h"
+#include "spsc_ring.h"
+#include "audio_frame_pool.h"
+#include "audio_mixer.h"
+#include "jitter_buffer.h"
+#include "ogg_sound_index.h"
+#include "opus_decoder_cache.h"
+#include "opus_encoder_controller.h"
+#include "voice_endpointer.h"
 
 
 /*
  * There are two types of audio data flow:
  * 1. (MIC) -> [Processors] -> {Encode Queue} -> [Opus Encoder] -> {Send Queue} -> (Server)
- * 2. (Server) -> {Decode Queue} -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
+ * 2. (Server) -> {Decode Queue} -> [Jitter Buffer] -> [Opus Decoder] -> {Playback Queue} -> [Mixer] -> (Speaker)
+ *    (Sounds) -> {Cue Queue} -> [Cue Opus Decoder] -> {Cue Playback Queue} -> [Mixer]
  *
- * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
+ * We use one task for MIC / Speaker / Processors, and separate tasks for the Opus Encoder and the
+ * Opus Decoder, so full-duplex encode and decode never wait for each other.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
- * 
+ *
+ * Every queue is a preallocated lock-free SPSC ring. Each push wakes only the task that consumes
+ * that ring (via task notification), so playback traffic never wakes or blocks the input task.
+ * Queues with more than one producer task serialize their producers with a producer-only mutex.
  */
 
 #define OPUS_FRAME_DURATION_MS 60
 #define MAX_ENCODE_TASKS_IN_QUEUE 2
 #define MAX_PLAYBACK_TASKS_IN_QUEUE 2
 #define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+#define MAX_CUE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
 #define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
+#define MAX_TESTING_PACKETS_IN_QUEUE (AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS)
 #define MAX_TIMESTAMPS_IN_QUEUE 3
+#define AUDIO_QUEUE_WAIT_MS 20
+// The input task always reads the microphone in blocks of this size, whatever its consumer needs
+#define AUDIO_INPUT_BLOCK_MS 10
+// 16 kHz samples of all input channels held between two consumers: the longest feed plus one block
+#define AUDIO_INPUT_RING_SAMPLES (16000 / 1000 * (OPUS_FRAME_DURATION_MS + AUDIO_INPUT_BLOCK_MS) * 2)
+// Ramp down at the end of aborted playback, short enough to be heard as a stop, long enough not to click
+#define AUDIO_ABORT_FADE_MS 8
 
 #define AUDIO_POWER_TIMEOUT_MS 15000
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
@@ -51,6 +73,7 @@
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_PLAYBACK_IDLE              (1 << 4)
 
 #define AS_OPUS_GET_FRAME_DRU_ENUM(duration_ms)                   \
     ((duration_ms) == 5 ? ESP_OPUS_ENC_FRAME_DURATION_5_MS :      \
@@ -79,6 +102,8 @@ struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
     std::function<void(const std::string&)> on_wake_word_detected;
     std::function<void(bool)> on_vad_change;
+    // The on-device endpointer decided the utterance is over, the uplink has stopped
+    std::function<void(void)> on_end_of_speech;
     std::function<void(void)> on_audio_testing_queue_full;
 };
 
@@ -89,10 +114,17 @@ enum AudioTaskType {
     kAudioTaskTypeDecodeToPlaybackQueue,
 };
 
+// Tasks and their PCM buffers are recycled through AudioFramePool. A task starts without a buffer,
+// whoever fills it acquires one from the pool or moves a recycled buffer in.
 struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
-    uint32_t timestamp;
+    uint32_t timestamp = 0;
+
+    ~AudioTask() { AudioFramePool::GetInstance().ReleasePcm(std::move(pcm)); }
+
+    static void* operator new(size_t size) { return AudioFramePool::GetInstance().AllocateTask(size); }
+    static void operator delete(void* ptr) { AudioFramePool::GetInstance().FreeTask(ptr); }
 };
 
 struct DebugStatistics {
@@ -100,6 +132,23 @@ struct DebugStatistics {
     uint32_t decode_count = 0;
     uint32_t encode_count = 0;
     uint32_t playback_count = 0;
+    // Frame pool counters, hits are served from recycled buffers, misses touch the heap
+    uint32_t pool_hits = 0;
+    uint32_t pool_misses = 0;
+    // Jitter buffer in front of the decoder
+    uint32_t jitter_late = 0;
+    uint32_t jitter_lost = 0;
+    uint32_t jitter_concealed = 0;
+    uint32_t jitter_depth = 0;
+    uint32_t jitter_target_depth = 0;
+    // Stream format switches served by an already open decoder
+    uint32_t decoder_cache_hits = 0;
+    uint32_t decoder_cache_misses = 0;
+    // Uplink frames the endpointer kept off the network (silence before and after speech)
+    uint32_t endpoint_dropped = 0;
+    // Server audio dropped after AbortPlayback(), and the delay until the speaker was silent
+    uint32_t abort_dropped = 0;
+    uint32_t abort_to_silence_ms = 0;
 };
 
 class AudioService {
@@ -119,10 +168,14 @@ public:
     bool IsWakeWordRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_WAKE_WORD_RUNNING; }
     bool IsAudioProcessorRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_PROCESSOR_RUNNING; }
     bool IsAfeWakeWord();
+    // The wake word runs on the audio processor's AFE and can stay on while listening
+    bool IsWakeWordSharingFrontEnd();
 
     void EnableWakeWordDetection(bool enable);
     void EnableVoiceProcessing(bool enable);
     void EnableAudioTesting(bool enable);
+    // Stops the uplink on the device when the user stops talking (CONFIG_USE_VOICE_ENDPOINTING)
+    void EnableEndpointing(bool enable);
     void EnableDeviceAec(bool enable);
 
     void SetCallbacks(AudioServiceCallbacks& callbacks);
@@ -130,9 +183,20 @@ public:
     bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
     std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
     void PlaySound(const std::string_view& sound);
+    // Level of a mixer voice in percent, and of the speech while a sound plays over it
+    void SetVoiceGain(AudioVoice voice, int percent) { mixer_.SetGain(voice, percent); }
+    void SetDuckGain(int percent) { mixer_.SetDuckGain(percent); }
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    // Barge-in: stops the reply at once and drops its packets until ResumePlayback() (next tts start)
+    void AbortPlayback();
+    void ResumePlayback();
+    // Picks the encoder parameters for a new session, returns the frame duration for the hello message
+    int ConfigureEncoderForSession();
+    void ReportNetworkRtt(int rtt_ms);
+    int encoder_frame_duration() const { return encoder_duration_ms_; }
     void SetModelsList(srmodel_list_t* models_list);
+    DebugStatistics GetDebugStatistics() const;
 
 private:
     AudioCodec* codec_ = nullptr;
@@ -141,7 +205,9 @@ private:
     std::unique_ptr<WakeWord> wake_word_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
     void* opus_encoder_ = nullptr;
+    // Current entry of decoder_cache_
     void* opus_decoder_ = nullptr;
+    std::mutex encoder_mutex_;
     std::mutex decoder_mutex_;
     std::mutex input_resampler_mutex_;
     esp_ae_rate_cvt_handle_t input_resampler_ = nullptr;
@@ -152,9 +218,13 @@ private:
     int encoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
     int encoder_frame_size_ = 0;
     int encoder_outbuf_size_ = 0;
+    bool encoder_fec_enabled_ = false;
+    OpusEncoderController encoder_controller_;
     int decoder_sample_rate_ = 0;
     int decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
     int decoder_frame_size_ = 0;
+    OpusDecoderCache decoder_cache_;
+    OggSoundIndex sound_index_;
     DebugStatistics debug_statistics_;
     srmodel_list_t* models_list_ = nullptr;
 
@@ -163,33 +233,73 @@ private:
     // Audio encode / decode
     TaskHandle_t audio_input_task_handle_ = nullptr;
     TaskHandle_t audio_output_task_handle_ = nullptr;
-    TaskHandle_t opus_codec_task_handle_ = nullptr;
-    std::mutex audio_queue_mutex_;
-    std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
+    TaskHandle_t opus_encode_task_handle_ = nullptr;
+    TaskHandle_t opus_decode_task_handle_ = nullptr;
+    SpscRing<std::unique_ptr<AudioStreamPacket>, MAX_DECODE_PACKETS_IN_QUEUE> audio_decode_queue_;
+    SpscRing<std::unique_ptr<AudioStreamPacket>, MAX_SEND_PACKETS_IN_QUEUE> audio_send_queue_;
+    SpscRing<std::unique_ptr<AudioStreamPacket>, MAX_TESTING_PACKETS_IN_QUEUE> audio_testing_queue_;
+    SpscRing<std::unique_ptr<AudioTask>, MAX_ENCODE_TASKS_IN_QUEUE> audio_encode_queue_;
+    SpscRing<std::unique_ptr<AudioTask>, MAX_PLAYBACK_TASKS_IN_QUEUE> audio_playback_queue_;
+    SpscRing<std::unique_ptr<AudioStreamPacket>, MAX_CUE_PACKETS_IN_QUEUE> audio_cue_queue_;
+    SpscRing<std::unique_ptr<AudioTask>, MAX_PLAYBACK_TASKS_IN_QUEUE> audio_cue_playback_queue_;
+    // Several tasks push to the decode and cue queues, wake word / processor / testing to the encode queue
+    std::mutex decode_producer_mutex_;
+    std::mutex cue_producer_mutex_;
+    std::mutex encode_producer_mutex_;
+    // Built-in sounds are decoded apart from the server audio and mixed over it
+    OpusDecoderCache cue_decoder_cache_;
+    OpusDecoderSlot* cue_decoder_ = nullptr;
+    AudioMixer mixer_;
+    std::atomic<bool> audio_testing_replay_ = false;
+    // Owned by the decode task, other tasks only request a reset or read its depth
+    JitterBuffer jitter_buffer_;
+    std::atomic<bool> jitter_buffer_reset_ = false;
+    std::atomic<bool> decoding_ = false;
+    // Set by AbortPlayback(), the output task fades out and flushes, the decode task drops frames
+    std::atomic<bool> playback_aborted_ = false;
+    std::atomic<bool> playback_abort_pending_ = false;
+    std::atomic<int64_t> playback_abort_time_us_ = 0;
+    // Owned by the audio processor output, other tasks only enable it or request a reset
+    std::unique_ptr<VoiceEndpointer> endpointer_;
+    std::deque<std::vector<int16_t>> endpoint_pre_roll_;
+    std::atomic<bool> endpointing_enabled_ = false;
+    std::atomic<bool> endpointer_reset_ = false;
     // For server AEC
+    std::mutex timestamp_mutex_;
     std::deque<uint32_t> timestamp_queue_;
 
     bool wake_word_initialized_ = false;
     bool audio_processor_initialized_ = false;
     bool voice_detected_ = false;
     bool service_stopped_ = true;
-    bool audio_input_need_warmup_ = false;
+    // 16 kHz samples read ahead of the current input consumer, carried over when it changes.
+    // Fixed ring of AUDIO_INPUT_RING_SAMPLES, only touched by the input task.
+    std::vector<int16_t> input_ring_;
+    size_t input_ring_read_ = 0;
+    size_t input_ring_size_ = 0;
 
     esp_timer_handle_t audio_power_timer_ = nullptr;
     std::chrono::steady_clock::time_point last_input_time_;
     std::chrono::steady_clock::time_point last_output_time_;
 
     void AudioInputTask();
+    // Takes the next samples of the continuous 16 kHz input stream for the input task's consumers
+    bool ReadInputStream(std::vector<int16_t>& data, int samples);
     void AudioOutputTask();
-    void OpusCodecTask();
+    void OpusEncodeTask();
+    void OpusDecodeTask();
     void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
+    void PushUplinkFrame(std::vector<int16_t>&& pcm);
+    void ClearEndpointPreRoll();
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
+    void DecodeCues();
+    void FadeOutAbortedPlayback();
+    void ResampleOutput(esp_ae_rate_cvt_handle_t resampler, std::vector<int16_t>& pcm);
+    void PushPacketToCueQueue(std::unique_ptr<AudioStreamPacket> packet);
+    bool OpenEncoder(const OpusEncoderParams& params);
     void CheckAndUpdateAudioPowerState();
+    void UpdatePlaybackIdleState();
+    void NotifyAudioTasks();
 };
 
 #endif
\ No newline at end of file
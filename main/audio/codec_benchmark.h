@@ -0,0 +1,49 @@
+#ifndef CODEC_BENCHMARK_H
+#define CODEC_BENCHMARK_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include <esp_log.h>
+
+#define CODEC_BENCHMARK_WINDOW 100
+
+/*
+ * Collects per-frame processing times of one codec task and logs percentiles every
+ * CODEC_BENCHMARK_WINDOW frames. A frame that takes longer than its own duration is a
+ * deadline miss: the task can no longer keep up with real time.
+ */
+class CodecBenchmark {
+public:
+    explicit CodecBenchmark(const char* name) : name_(name) {}
+
+    void Record(int64_t elapsed_us, int frame_duration_ms) {
+        samples_[count_++] = (uint32_t)elapsed_us;
+        if (elapsed_us > frame_duration_ms * 1000) {
+            deadline_misses_++;
+        }
+        if (count_ < samples_.size()) {
+            return;
+        }
+
+        std::sort(samples_.begin(), samples_.end());
+        ESP_LOGI("CodecBenchmark", "%s %d ms frames: p50=%luus p90=%luus p99=%luus max=%luus, deadline misses %lu/%u",
+            name_, frame_duration_ms, Percentile(50), Percentile(90), Percentile(99), samples_.back(),
+            deadline_misses_, (unsigned)samples_.size());
+        count_ = 0;
+        deadline_misses_ = 0;
+    }
+
+private:
+    const char* name_;
+    std::array<uint32_t, CODEC_BENCHMARK_WINDOW> samples_;
+    size_t count_ = 0;
+    uint32_t deadline_misses_ = 0;
+
+    uint32_t Percentile(int percent) const {
+        return samples_[(samples_.size() - 1) * percent / 100];
+    }
+};
+
+#endif // CODEC_BENCHMARK_H
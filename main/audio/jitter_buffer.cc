@@ -0,0 +1,190 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+
+#define TAG "JitterBuffer"
+
+// Deltas above this are a server restart or a long pause, not network jitter
+#define JITTER_BUFFER_MAX_TRANSIT_DELTA_US 5000000
+
+void JitterBuffer::Push(std::unique_ptr<AudioStreamPacket> packet, int64_t arrival_time_us) {
+    if (packet->frame_duration > 0) {
+        frame_duration_ms_ = packet->frame_duration;
+    }
+    if (packet->sequence == 0) {
+        packet->sequence = highest_sequence_ + 1;
+    }
+    uint32_t sequence = packet->sequence;
+
+    if (started_) {
+        int32_t offset = (int32_t)(sequence - next_sequence_);
+        if (offset < -JITTER_BUFFER_MAX_PACKETS || offset >= 4 * JITTER_BUFFER_MAX_PACKETS) {
+            ESP_LOGW(TAG, "Sequence jumped from %lu to %lu, restarting", next_sequence_, sequence);
+            Reset();
+        }
+    }
+
+    if (!started_) {
+        /* A new stream starts from its first packet instead of concealing the silence before it */
+        started_ = true;
+        played_ = false;
+        next_sequence_ = sequence;
+        highest_sequence_ = sequence;
+        fill_start_us_ = arrival_time_us;
+    } else if (!played_ && (int32_t)(sequence - next_sequence_) < 0) {
+        // Reordered ahead of the first packet, nothing was played yet so start from this one
+        next_sequence_ = sequence;
+    } else if (!playing_ && count_ == 0) {
+        /* Refilling after an underrun: the stream goes on, frames missing before this one are concealed */
+        fill_start_us_ = arrival_time_us;
+        int32_t gap = (int32_t)(sequence - next_sequence_);
+        if (gap >= JITTER_BUFFER_MAX_PACKETS) {
+            ESP_LOGW(TAG, "%ld frames missing after an underrun, skipping ahead", gap);
+            statistics_.lost += gap;
+            next_sequence_ = sequence;
+        }
+    }
+
+    int32_t offset = (int32_t)(sequence - next_sequence_);
+    if (offset < 0) {
+        statistics_.late++;
+        return;
+    }
+    /* Keep the window inside the slots, the oldest missing frames are given up */
+    while (offset >= JITTER_BUFFER_MAX_PACKETS) {
+        auto& slot = Slot(next_sequence_);
+        if (slot) {
+            slot.reset();
+            count_--;
+        }
+        statistics_.lost++;
+        next_sequence_++;
+        offset--;
+    }
+
+    auto& slot = Slot(sequence);
+    if (slot) {
+        statistics_.duplicates++;
+        return;
+    }
+    UpdateJitter(sequence, arrival_time_us);
+    if ((int32_t)(sequence - highest_sequence_) > 0) {
+        highest_sequence_ = sequence;
+    }
+    slot = std::move(packet);
+    count_++;
+}
+
+JitterBufferAction JitterBuffer::Pop(int64_t now_us, std::unique_ptr<AudioStreamPacket>& packet, int& wait_ms) {
+    wait_ms = -1;
+    if (count_ == 0) {
+        playing_ = false;
+        return kJitterBufferWait;
+    }
+
+    if (!playing_) {
+        int target = TargetDepth();
+        int64_t max_wait_ms = target * frame_duration_ms_;
+        int64_t waited_ms = (now_us - fill_start_us_) / 1000;
+        if ((int)count_ < target && waited_ms < max_wait_ms) {
+            wait_ms = max_wait_ms - waited_ms;
+            return kJitterBufferWait;
+        }
+        playing_ = true;
+        gap_start_us_ = 0;
+    }
+
+    auto& slot = Slot(next_sequence_);
+    if (slot) {
+        packet = std::move(slot);
+        count_--;
+        next_sequence_++;
+        gap_start_us_ = 0;
+        played_ = true;
+        return kJitterBufferPlay;
+    }
+
+    /* The next frame is missing but later ones are queued, give it half a frame to show up */
+    if (gap_start_us_ == 0) {
+        gap_start_us_ = now_us;
+    }
+    int64_t gap_ms = (now_us - gap_start_us_) / 1000;
+    int grace_ms = frame_duration_ms_ / 2;
+    if ((int)count_ < TargetDepth() && gap_ms < grace_ms) {
+        wait_ms = grace_ms - gap_ms;
+        return kJitterBufferWait;
+    }
+    next_sequence_++;
+    gap_start_us_ = 0;
+    played_ = true;
+    statistics_.lost++;
+    statistics_.concealed++;
+    return kJitterBufferConceal;
+}
+
+const AudioStreamPacket* JitterBuffer::Peek() const {
+    if (!started_) {
+        return nullptr;
+    }
+    return slots_[next_sequence_ % JITTER_BUFFER_MAX_PACKETS].get();
+}
+
+void JitterBuffer::Reset() {
+    Clear();
+    started_ = false;
+    playing_ = false;
+    has_last_transit_ = false;
+    gap_start_us_ = 0;
+}
+
+JitterBufferStatistics JitterBuffer::statistics() const {
+    JitterBufferStatistics statistics = statistics_;
+    statistics.depth = count_;
+    statistics.target_depth = TargetDepth();
+    statistics.jitter_ms = jitter_us_x16_ / 16 / 1000;
+    return statistics;
+}
+
+void JitterBuffer::UpdateJitter(uint32_t sequence, int64_t arrival_time_us) {
+    /*
+     * Transit time relative to the sender's clock, which advances one frame per sequence.
+     * Only late arrivals count: a server sending ahead of real time only fills the buffer.
+     */
+    int64_t transit_us = arrival_time_us - (int64_t)sequence * frame_duration_ms_ * 1000;
+    if (has_last_transit_) {
+        int64_t delta_us = transit_us - last_transit_us_;
+        if (delta_us < JITTER_BUFFER_MAX_TRANSIT_DELTA_US) {
+            if (delta_us < 0) {
+                delta_us = 0;
+            }
+            jitter_us_x16_ += delta_us - ((jitter_us_x16_ + 8) >> 4);
+            jitter_valid_ = true;
+        }
+    }
+    last_transit_us_ = transit_us;
+    has_last_transit_ = true;
+}
+
+int JitterBuffer::TargetDepth() const {
+    if (!jitter_valid_) {
+        return JITTER_BUFFER_INITIAL_DEPTH;
+    }
+    /* Cover twice the mean deviation, plus the frame being played */
+    int64_t frame_us = frame_duration_ms_ * 1000;
+    int64_t jitter_us = jitter_us_x16_ / 16;
+    int depth = 1 + (int)((2 * jitter_us + frame_us - 1) / frame_us);
+    if (depth < JITTER_BUFFER_MIN_DEPTH) {
+        depth = JITTER_BUFFER_MIN_DEPTH;
+    }
+    if (depth > JITTER_BUFFER_MAX_DEPTH) {
+        depth = JITTER_BUFFER_MAX_DEPTH;
+    }
+    return depth;
+}
+
+void JitterBuffer::Clear() {
+    for (auto& slot : slots_) {
+        slot.reset();
+    }
+    count_ = 0;
+}
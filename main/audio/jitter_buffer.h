@@ -0,0 +1,90 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "protocol.h"
+
+#define JITTER_BUFFER_MAX_PACKETS 32
+#define JITTER_BUFFER_MIN_DEPTH 1
+#define JITTER_BUFFER_MAX_DEPTH 6
+// Depth used before any inter-arrival jitter has been measured
+#define JITTER_BUFFER_INITIAL_DEPTH 2
+
+enum JitterBufferAction {
+    kJitterBufferWait,      // Nothing to play yet, wait for more packets
+    kJitterBufferPlay,      // Decode the returned packet
+    kJitterBufferConceal,   // The next frame is lost, conceal it (PLC, or FEC from Peek())
+};
+
+struct JitterBufferStatistics {
+    uint32_t late = 0;          // Arrived after its slot was already played or concealed
+    uint32_t lost = 0;          // Never arrived in time
+    uint32_t concealed = 0;     // Frames generated by PLC / FEC
+    uint32_t duplicates = 0;
+    uint32_t depth = 0;
+    uint32_t target_depth = 0;
+    uint32_t jitter_ms = 0;
+};
+
+/*
+ * Reorders incoming server audio by sequence number and paces it out to the decoder.
+ *
+ * Playout starts once the buffer holds target_depth frames (or has waited that long), the
+ * target is derived from the measured inter-arrival jitter (RFC 3550 estimator). A missing
+ * frame is concealed once enough later frames are queued behind it, or after it is one frame
+ * late, so reordered packets still get a chance to arrive.
+ * An underrun only refills the buffer: the stream keeps its sequence numbers, so frames lost
+ * meanwhile are concealed and reordered ones are still accepted.
+ *
+ * Packets with sequence 0 (reliable transports, local sounds) are numbered in arrival order.
+ * Only the decode task may call the methods, except depth() which any task can read.
+ */
+class JitterBuffer {
+public:
+    JitterBuffer() = default;
+    JitterBuffer(const JitterBuffer&) = delete;
+    JitterBuffer& operator=(const JitterBuffer&) = delete;
+
+    void Push(std::unique_ptr<AudioStreamPacket> packet, int64_t arrival_time_us);
+    JitterBufferAction Pop(int64_t now_us, std::unique_ptr<AudioStreamPacket>& packet, int& wait_ms);
+    // The packet right after a concealed frame, carries the in-band FEC of the lost one
+    const AudioStreamPacket* Peek() const;
+    // Drops all buffered packets, the statistics are kept
+    void Reset();
+
+    bool Full() const { return depth() >= JITTER_BUFFER_MAX_PACKETS; }
+    bool Empty() const { return depth() == 0; }
+    size_t depth() const { return count_.load(std::memory_order_acquire); }
+    JitterBufferStatistics statistics() const;
+
+private:
+    std::array<std::unique_ptr<AudioStreamPacket>, JITTER_BUFFER_MAX_PACKETS> slots_;
+    std::atomic<size_t> count_{0};
+    bool started_ = false;      // next_sequence_ is valid, until Reset() or a sequence jump
+    bool played_ = false;       // A frame of the stream was played or concealed
+    bool playing_ = false;      // false while (re)filling to the target depth
+    uint32_t next_sequence_ = 0;
+    uint32_t highest_sequence_ = 0;
+    bool has_last_transit_ = false;
+    int64_t last_transit_us_ = 0;
+    int64_t fill_start_us_ = 0;
+    int64_t gap_start_us_ = 0;
+    int frame_duration_ms_ = 60;
+    // Inter-arrival jitter in microseconds, scaled by 16 as in RFC 3550
+    int64_t jitter_us_x16_ = 0;
+    bool jitter_valid_ = false;
+    JitterBufferStatistics statistics_;
+
+    std::unique_ptr<AudioStreamPacket>& Slot(uint32_t sequence) {
+        return slots_[sequence % JITTER_BUFFER_MAX_PACKETS];
+    }
+    void UpdateJitter(uint32_t sequence, int64_t arrival_time_us);
+    int TargetDepth() const;
+    void Clear();
+};
+
+#endif // JITTER_BUFFER_H
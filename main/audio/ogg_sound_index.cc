@@ -0,0 +1,113 @@
+#include "ogg_sound_index.h"
+
+#include <cstring>
+#include <esp_log.h>
+#include <esp_memory_utils.h>
+
+#define TAG "OggSoundIndex"
+
+#define OGG_PAGE_HEADER_SIZE 27
+#define OGG_HEADER_TYPE_CONTINUED 0x01
+
+const OggSound* OggSoundIndex::Find(const std::string_view& ogg) {
+    if (!esp_ptr_in_drom(ogg.data())) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sounds_.find(ogg.data());
+    if (it != sounds_.end()) {
+        return &it->second;
+    }
+    OggSound sound;
+    if (!Parse(ogg, sound)) {
+        return nullptr;
+    }
+    ESP_LOGI(TAG, "Indexed %u packets at %d Hz", (unsigned)sound.packets.size(), sound.sample_rate);
+    return &sounds_.emplace(ogg.data(), std::move(sound)).first->second;
+}
+
+bool OggSoundIndex::Parse(const std::string_view& ogg, OggSound& sound) {
+    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
+    size_t size = ogg.size();
+    size_t offset = 0;
+    bool seen_head = false;
+    bool seen_tags = false;
+    bool skip_continued = false;
+
+    sound.packets.clear();
+    while (offset + OGG_PAGE_HEADER_SIZE <= size) {
+        const uint8_t* page = buf + offset;
+        if (memcmp(page, "OggS", 4) != 0) {
+            /* Pages follow each other, only a damaged stream needs a scan for the next one */
+            offset++;
+            continue;
+        }
+
+        uint8_t page_segments = page[26];
+        size_t body_off = offset + OGG_PAGE_HEADER_SIZE + page_segments;
+        if (body_off > size) {
+            break;
+        }
+        size_t body_size = 0;
+        for (size_t i = 0; i < page_segments; ++i) {
+            body_size += page[OGG_PAGE_HEADER_SIZE + i];
+        }
+        if (body_off + body_size > size) {
+            break;
+        }
+
+        // The rest of a packet started on the previous page
+        skip_continued = skip_continued && (page[5] & OGG_HEADER_TYPE_CONTINUED);
+
+        // Parse packets using lacing
+        size_t cur = body_off;
+        size_t seg_idx = 0;
+        while (seg_idx < page_segments) {
+            size_t pkt_len = 0;
+            size_t pkt_start = cur;
+            bool continued = false;
+            do {
+                uint8_t l = page[OGG_PAGE_HEADER_SIZE + seg_idx++];
+                pkt_len += l;
+                cur += l;
+                continued = (l == 255);
+            } while (continued && seg_idx < page_segments);
+
+            if (skip_continued) {
+                skip_continued = continued;
+                continue;
+            }
+            if (continued) {
+                /* Opus frames of the built-in sounds never span pages, drop such a packet */
+                ESP_LOGW(TAG, "Skipping packet continued on the next page");
+                skip_continued = true;
+                continue;
+            }
+            if (pkt_len == 0) {
+                continue;
+            }
+            const uint8_t* pkt_ptr = buf + pkt_start;
+
+            if (!seen_head) {
+                // OpusHead: [0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip,
+                // [12-15] input_sample_rate (little-endian), [16-17] output_gain, [18] mapping_family
+                if (pkt_len >= 19 && memcmp(pkt_ptr, "OpusHead", 8) == 0) {
+                    seen_head = true;
+                    sound.sample_rate = pkt_ptr[12] | (pkt_ptr[13] << 8) | (pkt_ptr[14] << 16) | (pkt_ptr[15] << 24);
+                }
+                continue;
+            }
+            if (!seen_tags) {
+                // Expect OpusTags in second packet
+                if (pkt_len >= 8 && memcmp(pkt_ptr, "OpusTags", 8) == 0) {
+                    seen_tags = true;
+                }
+                continue;
+            }
+            sound.packets.push_back({(uint32_t)pkt_start, (uint16_t)pkt_len});
+        }
+
+        offset = body_off + body_size;
+    }
+    return seen_head;
+}
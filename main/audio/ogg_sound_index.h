@@ -0,0 +1,39 @@
+#ifndef OGG_SOUND_INDEX_H
+#define OGG_SOUND_INDEX_H
+
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct OggSoundPacket {
+    uint32_t offset;
+    uint16_t length;
+};
+
+// Opus packets of an Ogg stream, as offsets into the stream
+struct OggSound {
+    int sample_rate = 16000;
+    std::vector<OggSoundPacket> packets;
+};
+
+/*
+ * Packet index of the built-in Ogg Opus sounds.
+ * Streams that live in flash are parsed on their first use and never change, so later plays
+ * skip the page walk and their packets can point straight at the flash data.
+ */
+class OggSoundIndex {
+public:
+    // Index of a stream in flash, nullptr for data elsewhere (it may be freed or reused)
+    const OggSound* Find(const std::string_view& ogg);
+
+    static bool Parse(const std::string_view& ogg, OggSound& sound);
+
+private:
+    std::mutex mutex_;
+    // Entries are never erased, so returned pointers stay valid
+    std::unordered_map<const char*, OggSound> sounds_;
+};
+
+#endif // OGG_SOUND_INDEX_H
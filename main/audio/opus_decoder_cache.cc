@@ -0,0 +1,84 @@
+#include "opus_decoder_cache.h"
+#include "audio_service.h"
+
+#include <esp_log.h>
+
+#define TAG "OpusDecoderCache"
+
+OpusDecoderCache::~OpusDecoderCache() {
+    Clear();
+}
+
+OpusDecoderSlot* OpusDecoderCache::Acquire(int sample_rate, int frame_duration) {
+    OpusDecoderSlot* victim = &slots_[0];
+    for (auto& slot : slots_) {
+        if (slot.decoder != nullptr && slot.sample_rate == sample_rate && slot.frame_duration == frame_duration) {
+            hits_++;
+            slot.last_used = ++clock_;
+            /* Drop the state left over from the last stream in this format */
+            esp_opus_dec_reset(slot.decoder);
+            return &slot;
+        }
+        if (victim->decoder != nullptr && (slot.decoder == nullptr || slot.last_used < victim->last_used)) {
+            victim = &slot;
+        }
+    }
+
+    misses_++;
+    Close(*victim);
+    if (!Open(*victim, sample_rate, frame_duration)) {
+        Close(*victim);
+        return nullptr;
+    }
+    victim->last_used = ++clock_;
+    return victim;
+}
+
+void OpusDecoderCache::Clear() {
+    for (auto& slot : slots_) {
+        Close(slot);
+    }
+}
+
+bool OpusDecoderCache::Open(OpusDecoderSlot& slot, int sample_rate, int frame_duration) {
+    esp_opus_dec_cfg_t opus_dec_cfg = {
+        .sample_rate = (uint32_t)sample_rate,
+        .channel = ESP_AUDIO_MONO,
+        .frame_duration = (esp_opus_dec_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(frame_duration),
+        .self_delimited = false,
+    };
+    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &slot.decoder);
+    if (slot.decoder == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
+        return false;
+    }
+    slot.sample_rate = sample_rate;
+    slot.frame_duration = frame_duration;
+
+    if (sample_rate != output_sample_rate_) {
+        ESP_LOGI(TAG, "Resampling audio from %d to %d", sample_rate, output_sample_rate_);
+        esp_ae_rate_cvt_cfg_t output_resampler_cfg = {
+            .src_rate = (uint32_t)sample_rate,
+            .dest_rate = (uint32_t)output_sample_rate_,
+            .channel = ESP_AUDIO_MONO,
+            .bits_per_sample = ESP_AUDIO_BIT16,
+            .complexity = 2,
+            .perf_type = ESP_AE_RATE_CVT_PERF_TYPE_SPEED,
+        };
+        auto resampler_ret = esp_ae_rate_cvt_open(&output_resampler_cfg, &slot.resampler);
+        if (slot.resampler == nullptr) {
+            ESP_LOGE(TAG, "Failed to create output resampler, error code: %d", resampler_ret);
+        }
+    }
+    return true;
+}
+
+void OpusDecoderCache::Close(OpusDecoderSlot& slot) {
+    if (slot.decoder != nullptr) {
+        esp_opus_dec_close(slot.decoder);
+    }
+    if (slot.resampler != nullptr) {
+        esp_ae_rate_cvt_close(slot.resampler);
+    }
+    slot = OpusDecoderSlot();
+}
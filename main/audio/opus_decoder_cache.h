@@ -0,0 +1,49 @@
+#ifndef OPUS_DECODER_CACHE_H
+#define OPUS_DECODER_CACHE_H
+
+#include <cstdint>
+
+#include "esp_opus_dec.h"
+#include "esp_ae_rate_cvt.h"
+
+// Server audio and the built-in sounds usually use two formats
+#define OPUS_DECODER_CACHE_SIZE 2
+
+struct OpusDecoderSlot {
+    int sample_rate = 0;
+    int frame_duration = 0;
+    void* decoder = nullptr;
+    // nullptr when the format already has the codec output sample rate
+    esp_ae_rate_cvt_handle_t resampler = nullptr;
+    uint32_t last_used = 0;
+};
+
+/*
+ * Keeps the decoder and output resampler of the last stream formats open, so switching
+ * between server audio and a built-in sound swaps pointers instead of reallocating codec
+ * state. The least recently used format is closed when a new one needs a slot.
+ */
+class OpusDecoderCache {
+public:
+    ~OpusDecoderCache();
+
+    void SetOutputSampleRate(int output_sample_rate) { output_sample_rate_ = output_sample_rate; }
+    // Decoder for the format, reset for a new stream; nullptr if it could not be opened
+    OpusDecoderSlot* Acquire(int sample_rate, int frame_duration);
+    void Clear();
+
+    uint32_t hits() const { return hits_; }
+    uint32_t misses() const { return misses_; }
+
+private:
+    OpusDecoderSlot slots_[OPUS_DECODER_CACHE_SIZE];
+    int output_sample_rate_ = 0;
+    uint32_t clock_ = 0;
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+
+    bool Open(OpusDecoderSlot& slot, int sample_rate, int frame_duration);
+    void Close(OpusDecoderSlot& slot);
+};
+
+#endif // OPUS_DECODER_CACHE_H
@@ -0,0 +1,110 @@
+#include "opus_encoder_controller.h"
+
+#include <algorithm>
+#include <esp_log.h>
+
+#define TAG "OpusEncoderController"
+
+void OpusEncoderController::ReportRtt(int rtt_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    /* Smooth over sessions, a single slow hello should not drop the link to poor */
+    rtt_ms_ = rtt_ms_ < 0 ? rtt_ms : (rtt_ms_ * 3 + rtt_ms) / 4;
+}
+
+OpusEncoderParams OpusEncoderController::NegotiateSession() {
+    std::lock_guard<std::mutex> lock(mutex_);
+#if CONFIG_USE_OPUS_ENCODER_CONTROLLER
+    if (rtt_ms_ < 0) {
+        quality_ = congested_ ? kOpusLinkPoor : kOpusLinkUnknown;
+    } else if (congested_ || rtt_ms_ > OPUS_CONTROLLER_POOR_RTT_MS) {
+        quality_ = kOpusLinkPoor;
+    } else if (rtt_ms_ <= OPUS_CONTROLLER_GOOD_RTT_MS) {
+        quality_ = kOpusLinkGood;
+    } else {
+        quality_ = kOpusLinkFair;
+    }
+
+    params_.frame_duration_ms = OPUS_CONTROLLER_DEFAULT_FRAME_DURATION_MS;
+    switch (quality_) {
+    case kOpusLinkGood:
+#if CONFIG_OPUS_ENCODER_ALLOW_SHORT_FRAMES
+        params_.frame_duration_ms = OPUS_CONTROLLER_SHORT_FRAME_DURATION_MS;
+#endif
+        params_.bitrate = 24000;
+        params_.enable_fec = false;
+        break;
+    case kOpusLinkPoor:
+        /* In-band FEC lets the server rebuild a lost frame from the next one */
+        params_.bitrate = 12000;
+        params_.enable_fec = true;
+        break;
+    case kOpusLinkFair:
+        params_.bitrate = 16000;
+        params_.enable_fec = false;
+        break;
+    default:
+        /* Nothing measured yet, keep the encoder's own choice until a hello round trip is known */
+        params_.bitrate = 0;
+        params_.enable_fec = false;
+        break;
+    }
+    max_bitrate_ = params_.bitrate;
+    congested_ = false;
+    hold_ms_ = 0;
+    calm_ms_ = 0;
+    ESP_LOGI(TAG, "Session link quality %d (rtt %d ms): %d ms frames, %d bps, fec %d",
+        quality_, rtt_ms_, params_.frame_duration_ms, params_.bitrate, params_.enable_fec);
+#endif
+    return params_;
+}
+
+bool OpusEncoderController::OnFrameQueued(size_t send_queue_depth, int& bitrate) {
+#if CONFIG_USE_OPUS_ENCODER_CONTROLLER
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (params_.bitrate == 0) {
+        return false;
+    }
+
+    int frame_ms = params_.frame_duration_ms;
+    int backlog_ms = send_queue_depth * frame_ms;
+    hold_ms_ = std::max(0, hold_ms_ - frame_ms);
+    if (backlog_ms >= OPUS_CONTROLLER_BACKLOG_MS) {
+        congested_ = true;
+        calm_ms_ = 0;
+        if (hold_ms_ > 0 || params_.bitrate <= OPUS_CONTROLLER_MIN_BITRATE) {
+            return false;
+        }
+        params_.bitrate = std::max(OPUS_CONTROLLER_MIN_BITRATE, params_.bitrate * 3 / 4);
+        hold_ms_ = OPUS_CONTROLLER_HOLD_MS;
+        ESP_LOGW(TAG, "Send queue backlog %d ms, bitrate down to %d", backlog_ms, params_.bitrate);
+        bitrate = params_.bitrate;
+        return true;
+    }
+
+    if (send_queue_depth > 0) {
+        calm_ms_ = 0;
+        return false;
+    }
+    calm_ms_ += frame_ms;
+    if (calm_ms_ < OPUS_CONTROLLER_RECOVER_MS || params_.bitrate >= max_bitrate_) {
+        return false;
+    }
+    calm_ms_ = 0;
+    params_.bitrate = std::min(max_bitrate_, params_.bitrate + OPUS_CONTROLLER_BITRATE_STEP);
+    ESP_LOGI(TAG, "Send queue drained, bitrate up to %d", params_.bitrate);
+    bitrate = params_.bitrate;
+    return true;
+#else
+    return false;
+#endif
+}
+
+OpusEncoderParams OpusEncoderController::params() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return params_;
+}
+
+OpusLinkQuality OpusEncoderController::link_quality() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return quality_;
+}
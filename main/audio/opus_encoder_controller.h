@@ -0,0 +1,62 @@
+#ifndef OPUS_ENCODER_CONTROLLER_H
+#define OPUS_ENCODER_CONTROLLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#define OPUS_CONTROLLER_DEFAULT_FRAME_DURATION_MS 60
+#define OPUS_CONTROLLER_SHORT_FRAME_DURATION_MS 20
+#define OPUS_CONTROLLER_GOOD_RTT_MS 120
+#define OPUS_CONTROLLER_POOR_RTT_MS 400
+#define OPUS_CONTROLLER_MIN_BITRATE 8000
+#define OPUS_CONTROLLER_BITRATE_STEP 2000
+// Audio waiting in the send queue that counts as a congested uplink
+#define OPUS_CONTROLLER_BACKLOG_MS 240
+// Time the send queue must stay empty before the bitrate is raised again
+#define OPUS_CONTROLLER_RECOVER_MS 5000
+#define OPUS_CONTROLLER_HOLD_MS 1000
+
+struct OpusEncoderParams {
+    int frame_duration_ms = OPUS_CONTROLLER_DEFAULT_FRAME_DURATION_MS;
+    int bitrate = 0;            // 0 lets the encoder pick (ESP_OPUS_BITRATE_AUTO)
+    bool enable_fec = false;
+};
+
+enum OpusLinkQuality {
+    kOpusLinkUnknown,
+    kOpusLinkGood,
+    kOpusLinkFair,
+    kOpusLinkPoor,
+};
+
+/*
+ * Chooses the Opus encoder parameters from the measured link quality.
+ *
+ * Frame duration and FEC need a new encoder and are announced in the hello message, so they
+ * only change at session start. The bitrate follows the send queue depth during the session:
+ * it drops when audio backs up and slowly climbs back once the queue stays empty.
+ */
+class OpusEncoderController {
+public:
+    // Round trip time of the last hello exchange
+    void ReportRtt(int rtt_ms);
+    // Parameters for the next session, called before the hello message is built
+    OpusEncoderParams NegotiateSession();
+    // Called by the encode task for every queued frame, returns true when the bitrate changes
+    bool OnFrameQueued(size_t send_queue_depth, int& bitrate);
+    OpusEncoderParams params();
+    OpusLinkQuality link_quality();
+
+private:
+    std::mutex mutex_;
+    OpusEncoderParams params_;
+    OpusLinkQuality quality_ = kOpusLinkUnknown;
+    int rtt_ms_ = -1;
+    int max_bitrate_ = 0;
+    bool congested_ = false;    // The send queue backed up during this session
+    int hold_ms_ = 0;
+    int calm_ms_ = 0;
+};
+
+#endif // OPUS_ENCODER_CONTROLLER_H
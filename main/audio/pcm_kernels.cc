@@ -0,0 +1,111 @@
+#include "pcm_kernels.h"
+
+#include <algorithm>
+
+// The codecs clamp to +-INT16_MAX so a full scale negative sample can be inverted safely
+static inline int16_t Saturate16(int32_t value) {
+    return (int16_t)std::min<int32_t>(INT16_MAX, std::max<int32_t>(-INT16_MAX, value));
+}
+
+int32_t PcmVolumeFactor(int volume) {
+    volume = std::min(100, std::max(0, volume));
+    return volume * volume * PCM_VOLUME_UNITY / 10000;
+}
+
+void PcmScale16To32(const int16_t* in, int32_t* out, size_t samples, int32_t factor, int channels) {
+    /* Up to unity gain the product always fits in 32 bits, no per sample clamping needed */
+    factor = std::min<int32_t>(PCM_VOLUME_UNITY, std::max<int32_t>(0, factor));
+    if (channels == 1) {
+        size_t i = 0;
+        for (; i + 4 <= samples; i += 4) {
+            out[i] = in[i] * factor;
+            out[i + 1] = in[i + 1] * factor;
+            out[i + 2] = in[i + 2] * factor;
+            out[i + 3] = in[i + 3] * factor;
+        }
+        for (; i < samples; i++) {
+            out[i] = in[i] * factor;
+        }
+        return;
+    }
+    for (size_t i = 0; i < samples; i++) {
+        int32_t value = in[i] * factor;
+        for (int c = 0; c < channels; c++) {
+            *out++ = value;
+        }
+    }
+}
+
+void PcmConvert32To16(const int32_t* in, int16_t* out, size_t samples, int shift) {
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        out[i] = Saturate16(in[i] >> shift);
+        out[i + 1] = Saturate16(in[i + 1] >> shift);
+        out[i + 2] = Saturate16(in[i + 2] >> shift);
+        out[i + 3] = Saturate16(in[i + 3] >> shift);
+    }
+    for (; i < samples; i++) {
+        out[i] = Saturate16(in[i] >> shift);
+    }
+}
+
+size_t PcmExtractChannel(const int16_t* in, int16_t* out, size_t frames, int channels, int channel) {
+    /* Reads run ahead of writes, so extracting in place is safe */
+    in += channel;
+    if (channels == 2) {
+        for (size_t i = 0; i < frames; i++) {
+            out[i] = in[i * 2];
+        }
+        return frames;
+    }
+    for (size_t i = 0; i < frames; i++) {
+        out[i] = in[i * channels];
+    }
+    return frames;
+}
+
+void PcmScale16(int16_t* data, size_t samples, int32_t factor) {
+    factor = std::min<int32_t>(PCM_VOLUME_UNITY, std::max<int32_t>(0, factor));
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        data[i] = (data[i] * factor) >> 16;
+        data[i + 1] = (data[i + 1] * factor) >> 16;
+        data[i + 2] = (data[i + 2] * factor) >> 16;
+        data[i + 3] = (data[i + 3] * factor) >> 16;
+    }
+    for (; i < samples; i++) {
+        data[i] = (data[i] * factor) >> 16;
+    }
+}
+
+void PcmMix16(int16_t* dst, const int16_t* src, size_t samples, int32_t factor) {
+    factor = std::min<int32_t>(PCM_VOLUME_UNITY, std::max<int32_t>(0, factor));
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        dst[i] = Saturate16(dst[i] + ((src[i] * factor) >> 16));
+        dst[i + 1] = Saturate16(dst[i + 1] + ((src[i + 1] * factor) >> 16));
+        dst[i + 2] = Saturate16(dst[i + 2] + ((src[i + 2] * factor) >> 16));
+        dst[i + 3] = Saturate16(dst[i + 3] + ((src[i + 3] * factor) >> 16));
+    }
+    for (; i < samples; i++) {
+        dst[i] = Saturate16(dst[i] + ((src[i] * factor) >> 16));
+    }
+}
+
+void PcmFadeOut16(int16_t* data, size_t samples) {
+    if (samples == 0) {
+        return;
+    }
+    int32_t step = PCM_VOLUME_UNITY / samples;
+    int32_t factor = PCM_VOLUME_UNITY;
+    for (size_t i = 0; i < samples; i++) {
+        factor -= step;
+        data[i] = (data[i] * factor) >> 16;
+    }
+}
+
+void PcmApplyGain16(int16_t* data, size_t samples, int gain) {
+    for (size_t i = 0; i < samples; i++) {
+        data[i] = Saturate16(data[i] * gain);
+    }
+}
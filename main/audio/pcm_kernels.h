@@ -0,0 +1,41 @@
+#ifndef PCM_KERNELS_H
+#define PCM_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Sample format loops shared by the codecs and the audio pipeline.
+ * All of them are branch free and work on caller buffers, so they can run on every frame
+ * without touching the heap.
+ */
+
+// Unity gain of the factors used by PcmScale16To32
+#define PCM_VOLUME_UNITY 65536
+
+// Output volume 0-100 mapped on a square curve to a factor of PcmScale16To32
+int32_t PcmVolumeFactor(int volume);
+
+// Scales 16 bit samples into the upper bits of 32 bit I2S samples, each one repeated
+// on `channels` consecutive output slots (mono to stereo for codecs that need it)
+void PcmScale16To32(const int16_t* in, int32_t* out, size_t samples, int32_t factor, int channels = 1);
+
+// Shifts 32 bit I2S samples down and saturates them to 16 bit
+void PcmConvert32To16(const int32_t* in, int16_t* out, size_t samples, int shift);
+
+// Copies one channel of interleaved frames, out may be the same buffer as in
+size_t PcmExtractChannel(const int16_t* in, int16_t* out, size_t frames, int channels, int channel = 0);
+
+// Scales 16 bit samples in place by a factor of at most PCM_VOLUME_UNITY
+void PcmScale16(int16_t* data, size_t samples, int32_t factor);
+
+// Adds src scaled by a factor of at most PCM_VOLUME_UNITY to dst, with saturation
+void PcmMix16(int16_t* dst, const int16_t* src, size_t samples, int32_t factor);
+
+// Ramps 16 bit samples linearly from unity gain down to silence, in place
+void PcmFadeOut16(int16_t* data, size_t samples);
+
+// Integer gain with saturation, in place
+void PcmApplyGain16(int16_t* data, size_t samples, int gain);
+
+#endif // PCM_KERNELS_H
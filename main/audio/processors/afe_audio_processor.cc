@@ -1,18 +1,24 @@
 #include "afe_audio_processor.h"
+#include "audio_frame_pool.h"
 #include <esp_log.h>
 
 #define PROCESSOR_RUNNING 0x01
+#define WAKE_WORD_RUNNING 0x02
 
 #define TAG "AfeAudioProcessor"
 
-AfeAudioProcessor::AfeAudioProcessor()
-    : afe_data_(nullptr) {
+AfeAudioProcessor::AfeAudioProcessor(bool shared_wake_word)
+    : afe_data_(nullptr), shared_wake_word_(shared_wake_word) {
     event_group_ = xEventGroupCreate();
 }
 
 void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) {
-    codec_ = codec;
     frame_samples_ = frame_duration_ms * 16000 / 1000;
+    if (afe_data_ != nullptr) {
+        // The shared wake word initialized the front end first
+        return;
+    }
+    codec_ = codec;
 
     // Pre-allocate output buffer capacity
     output_buffer_.reserve(frame_samples_);
@@ -33,12 +39,22 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
     } else {
         models = models_list;
     }
+    models_ = models;
 
     char* ns_model_name = esp_srmodel_filter(models, ESP_NSNET_PREFIX, NULL);
     char* vad_model_name = esp_srmodel_filter(models, ESP_VADN_PREFIX, NULL);
     
-    afe_config_t* afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
-    afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
+    afe_config_t* afe_config;
+    if (shared_wake_word_) {
+        /* WakeNet needs the SR pipeline, the encoder takes the same cleaned stream */
+        afe_config = afe_config_init(input_format.c_str(), models, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
+        afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
+        afe_config->afe_perferred_core = 1;
+        afe_config->afe_perferred_priority = 1;
+    } else {
+        afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
+        afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
+    }
     afe_config->vad_mode = VAD_MODE_0;
     afe_config->vad_min_noise_ms = 100;
     if (vad_model_name != nullptr) {
@@ -63,6 +79,10 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
     afe_config->aec_init = false;
     afe_config->vad_init = true;
 #endif
+    if (shared_wake_word_) {
+        // Echo cancellation keeps the wake word usable while a reply plays
+        afe_config->aec_init = codec_->input_reference();
+    }
 
     afe_iface_ = esp_afe_handle_from_config(afe_config);
     afe_data_ = afe_iface_->create_from_config(afe_config);
@@ -74,6 +94,10 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
     }, "audio_communication", 4096, this, 3, NULL);
 }
 
+void AfeAudioProcessor::SetFrameDuration(int frame_duration_ms) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+}
+
 AfeAudioProcessor::~AfeAudioProcessor() {
     if (afe_data_ != nullptr) {
         afe_iface_->destroy(afe_data_);
@@ -89,10 +113,14 @@ size_t AfeAudioProcessor::GetFeedSize() {
 }
 
 void AfeAudioProcessor::Feed(std::vector<int16_t>&& data) {
+    FeedChunk(data.data());
+}
+
+void AfeAudioProcessor::FeedChunk(const int16_t* data) {
     if (afe_data_ == nullptr) {
         return;
     }
-    afe_iface_->feed(afe_data_, data.data());
+    afe_iface_->feed(afe_data_, data);
 }
 
 void AfeAudioProcessor::Start() {
@@ -100,12 +128,28 @@ void AfeAudioProcessor::Start() {
 }
 
 void AfeAudioProcessor::Stop() {
-    xEventGroupClearBits(event_group_, PROCESSOR_RUNNING);
-    if (afe_data_ != nullptr) {
+    auto bits = xEventGroupClearBits(event_group_, PROCESSOR_RUNNING);
+    /* The front end keeps its state while the wake word still uses it */
+    if (afe_data_ != nullptr && !(bits & WAKE_WORD_RUNNING)) {
         afe_iface_->reset_buffer(afe_data_);
     }
 }
 
+void AfeAudioProcessor::EnableWakeWord(bool enable) {
+    if (enable) {
+        xEventGroupSetBits(event_group_, WAKE_WORD_RUNNING);
+        return;
+    }
+    auto bits = xEventGroupClearBits(event_group_, WAKE_WORD_RUNNING);
+    if (afe_data_ != nullptr && !(bits & PROCESSOR_RUNNING)) {
+        afe_iface_->reset_buffer(afe_data_);
+    }
+}
+
+void AfeAudioProcessor::OnWakeWordChunk(std::function<void(const int16_t* data, size_t samples, int wake_word_index)> callback) {
+    wake_word_chunk_callback_ = callback;
+}
+
 bool AfeAudioProcessor::IsRunning() {
     return xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING;
 }
@@ -125,10 +169,11 @@ void AfeAudioProcessor::AudioProcessorTask() {
         feed_size, fetch_size);
 
     while (true) {
-        xEventGroupWaitBits(event_group_, PROCESSOR_RUNNING, pdFALSE, pdTRUE, portMAX_DELAY);
+        xEventGroupWaitBits(event_group_, PROCESSOR_RUNNING | WAKE_WORD_RUNNING, pdFALSE, pdFALSE, portMAX_DELAY);
 
         auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
-        if ((xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING) == 0) {
+        auto bits = xEventGroupGetBits(event_group_);
+        if ((bits & (PROCESSOR_RUNNING | WAKE_WORD_RUNNING)) == 0) {
             continue;
         }
         if (res == nullptr || res->ret_value == ESP_FAIL) {
@@ -138,6 +183,14 @@ void AfeAudioProcessor::AudioProcessorTask() {
             continue;
         }
 
+        if ((bits & WAKE_WORD_RUNNING) && wake_word_chunk_callback_) {
+            int wake_word_index = res->wakeup_state == WAKENET_DETECTED ? res->wakenet_model_index : 0;
+            wake_word_chunk_callback_(res->data, res->data_size / sizeof(int16_t), wake_word_index);
+        }
+        if ((bits & PROCESSOR_RUNNING) == 0) {
+            continue;
+        }
+
         // VAD state change
         if (vad_state_change_callback_) {
             if (res->vad_state == VAD_SPEECH && !is_speaking_) {
@@ -158,13 +211,15 @@ void AfeAudioProcessor::AudioProcessorTask() {
             // Output complete frames when buffer has enough data
             while (output_buffer_.size() >= frame_samples_) {
                 if (output_buffer_.size() == frame_samples_) {
-                    // If buffer size equals frame size, move the entire buffer
+                    // If buffer size equals frame size, move the entire buffer and take a recycled one
                     output_callback_(std::move(output_buffer_));
-                    output_buffer_.clear();
+                    output_buffer_ = AudioFramePool::GetInstance().AcquirePcm();
                     output_buffer_.reserve(frame_samples_);
                 } else {
                     // If buffer size exceeds frame size, copy one frame and remove it
-                    output_callback_(std::vector<int16_t>(output_buffer_.begin(), output_buffer_.begin() + frame_samples_));
+                    auto frame = AudioFramePool::GetInstance().AcquirePcm();
+                    frame.assign(output_buffer_.begin(), output_buffer_.begin() + frame_samples_);
+                    output_callback_(std::move(frame));
                     output_buffer_.erase(output_buffer_.begin(), output_buffer_.begin() + frame_samples_);
                 }
             }
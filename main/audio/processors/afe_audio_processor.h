@@ -13,12 +13,18 @@
 #include "audio_processor.h"
 #include "audio_codec.h"
 
+/*
+ * With a shared wake word (CONFIG_USE_SHARED_AFE_FRONT_END) one AFE_TYPE_SR instance runs AEC,
+ * NS, VAD and WakeNet once, and its output feeds both the encoder and SharedAfeWakeWord.
+ * Otherwise the processor builds an AFE_TYPE_VC instance for voice communication only.
+ */
 class AfeAudioProcessor : public AudioProcessor {
 public:
-    AfeAudioProcessor();
+    AfeAudioProcessor(bool shared_wake_word = false);
     ~AfeAudioProcessor();
 
     void Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) override;
+    void SetFrameDuration(int frame_duration_ms) override;
     void Feed(std::vector<int16_t>&& data) override;
     void Start() override;
     void Stop() override;
@@ -28,12 +34,21 @@ public:
     size_t GetFeedSize() override;
     void EnableDeviceAec(bool enable) override;
 
+    // Shared front end only: every fetched chunk and the index of a detected wake word (0 if none)
+    void OnWakeWordChunk(std::function<void(const int16_t* data, size_t samples, int wake_word_index)> callback);
+    void EnableWakeWord(bool enable);
+    void FeedChunk(const int16_t* data);
+    srmodel_list_t* models() const { return models_; }
+
 private:
     EventGroupHandle_t event_group_ = nullptr;
     const esp_afe_sr_iface_t* afe_iface_ = nullptr;
     esp_afe_sr_data_t* afe_data_ = nullptr;
     std::function<void(std::vector<int16_t>&& data)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
+    std::function<void(const int16_t* data, size_t samples, int wake_word_index)> wake_word_chunk_callback_;
+    bool shared_wake_word_;
+    srmodel_list_t* models_ = nullptr;
     AudioCodec* codec_ = nullptr;
     int frame_samples_ = 0;
     bool is_speaking_ = false;
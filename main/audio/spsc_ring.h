@@ -0,0 +1,166 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/*
+ * Fixed-capacity single-producer / single-consumer ring used between the audio tasks.
+ *
+ * All slots are allocated up front, Push() and Pop() never block and never take a lock.
+ * Wakeups go through FreeRTOS task notifications, so only the task that owns the other
+ * end of the ring is woken instead of every audio task at once.
+ *
+ * Clear() may be called from any task: it only records the current write position, and
+ * the consumer releases the flushed items the next time it calls Pop().
+ */
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert(Capacity > 0, "SpscRing capacity must be positive");
+
+public:
+    SpscRing() = default;
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    static constexpr size_t capacity() { return Capacity; }
+
+    // The consumer task is notified whenever an item is pushed or the ring is cleared
+    void SetConsumer(TaskHandle_t task) { consumer_task_.store(task, std::memory_order_release); }
+
+    // Producer side. The item is only moved from when the push succeeds.
+    bool Push(T&& item) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) >= Capacity) {
+            return false;
+        }
+        slots_[head & kMask] = std::move(item);
+        head_.store(head + 1, std::memory_order_release);
+        NotifyConsumer();
+        return true;
+    }
+
+    // Consumer side
+    bool Pop(T& item) {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        bool reclaimed = ReclaimFlushed(tail);
+        if (tail == head_.load(std::memory_order_acquire)) {
+            if (reclaimed) {
+                tail_.store(tail, std::memory_order_release);
+                NotifyProducer();
+            }
+            return false;
+        }
+        item = std::move(slots_[tail & kMask]);
+        slots_[tail & kMask] = T();
+        tail_.store(tail + 1, std::memory_order_release);
+        NotifyProducer();
+        return true;
+    }
+
+    // Any task. Items pushed before this call are dropped by the consumer.
+    void Clear() {
+        flush_to_.store(head_.load(std::memory_order_acquire), std::memory_order_release);
+        NotifyConsumer();
+    }
+
+    size_t Size() const {
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t flush = flush_to_.load(std::memory_order_acquire);
+        if (static_cast<int32_t>(flush - tail) > 0) {
+            tail = flush;
+        }
+        return head - tail;
+    }
+
+    bool Empty() const { return Size() == 0; }
+
+    // Counts flushed items that the consumer has not released yet
+    bool Full() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire) >= Capacity;
+    }
+
+    // Block the calling producer until the consumer frees a slot or the timeout expires
+    bool WaitForSpace(TickType_t timeout) {
+        if (!ArmProducerWakeup()) {
+            return true;
+        }
+        ulTaskNotifyTake(pdTRUE, timeout);
+        producer_waiter_.store(nullptr, std::memory_order_release);
+        return !Full();
+    }
+
+    // Ask for a notification on the next Pop() without blocking, for tasks that wait on
+    // several rings at once. Returns false without arming when a slot is already free, a Pop()
+    // between the caller's Full() check and the arming would otherwise never wake it.
+    bool ArmProducerWakeup() {
+        if (!Full()) {
+            return false;
+        }
+        producer_waiter_.store(xTaskGetCurrentTaskHandle(), std::memory_order_release);
+        if (!Full()) {
+            producer_waiter_.store(nullptr, std::memory_order_release);
+            return false;
+        }
+        return true;
+    }
+
+    void DisarmProducerWakeup() {
+        TaskHandle_t task = xTaskGetCurrentTaskHandle();
+        producer_waiter_.compare_exchange_strong(task, nullptr, std::memory_order_acq_rel);
+    }
+
+private:
+    static constexpr uint32_t RoundUpPowerOfTwo(uint32_t v) {
+        uint32_t n = 1;
+        while (n < v) {
+            n <<= 1;
+        }
+        return n;
+    }
+
+    static constexpr uint32_t kSlots = RoundUpPowerOfTwo(Capacity);
+    static constexpr uint32_t kMask = kSlots - 1;
+
+    std::array<T, kSlots> slots_{};
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> flush_to_{0};
+    std::atomic<TaskHandle_t> consumer_task_{nullptr};
+    std::atomic<TaskHandle_t> producer_waiter_{nullptr};
+
+    bool ReclaimFlushed(uint32_t& tail) {
+        uint32_t flush = flush_to_.load(std::memory_order_acquire);
+        if (static_cast<int32_t>(flush - tail) <= 0) {
+            return false;
+        }
+        while (tail != flush) {
+            slots_[tail & kMask] = T();
+            tail++;
+        }
+        return true;
+    }
+
+    void NotifyConsumer() {
+        TaskHandle_t task = consumer_task_.load(std::memory_order_acquire);
+        if (task != nullptr) {
+            xTaskNotifyGive(task);
+        }
+    }
+
+    void NotifyProducer() {
+        TaskHandle_t task = producer_waiter_.exchange(nullptr, std::memory_order_acq_rel);
+        if (task != nullptr) {
+            xTaskNotifyGive(task);
+        }
+    }
+};
+
+#endif // SPSC_RING_H
@@ -0,0 +1,56 @@
+#include "voice_endpointer.h"
+
+VoiceEndpointer::VoiceEndpointer(int min_speech_ms, int end_silence_ms, int pre_roll_ms, int no_speech_timeout_ms)
+    : min_speech_ms_(min_speech_ms), end_silence_ms_(end_silence_ms), pre_roll_ms_(pre_roll_ms),
+      no_speech_timeout_ms_(no_speech_timeout_ms) {
+}
+
+void VoiceEndpointer::Reset() {
+    state_ = kStateWaiting;
+    waited_ms_ = 0;
+    speech_ms_ = 0;
+    silence_ms_ = 0;
+}
+
+EndpointAction VoiceEndpointer::Process(bool speech, int frame_ms) {
+    switch (state_) {
+    case kStateWaiting:
+        if (speech) {
+            state_ = kStateSpeech;
+            speech_ms_ += frame_ms;
+            silence_ms_ = 0;
+            return kEndpointSend;
+        }
+        waited_ms_ += frame_ms;
+        if (no_speech_timeout_ms_ > 0 && waited_ms_ >= no_speech_timeout_ms_) {
+            state_ = kStateEnded;
+            speech_ms_ = 0;
+            return kEndpointEnd;
+        }
+        return kEndpointHold;
+
+    case kStateSpeech:
+        if (speech) {
+            speech_ms_ += frame_ms;
+            silence_ms_ = 0;
+            return kEndpointSend;
+        }
+        silence_ms_ += frame_ms;
+        if (silence_ms_ < end_silence_ms_) {
+            /* Hangover: short pauses between words belong to the utterance */
+            return kEndpointSend;
+        }
+        if (speech_ms_ >= min_speech_ms_) {
+            state_ = kStateEnded;
+            return kEndpointEnd;
+        }
+        /* Too short to be speech, the no speech timeout keeps running */
+        state_ = kStateWaiting;
+        speech_ms_ = 0;
+        return kEndpointHold;
+
+    case kStateEnded:
+    default:
+        return kEndpointDrop;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef VOICE_ENDPOINTER_H
+#define VOICE_ENDPOINTER_H
+
+#include <cstdint>
+
+enum EndpointAction {
+    kEndpointHold,      // No speech yet, keep the frame as pre-roll
+    kEndpointSend,      // Part of the utterance, send it
+    kEndpointEnd,       // Send it, the utterance is over (or never started before the timeout)
+    kEndpointDrop,      // After the end, drop it
+};
+
+/*
+ * Decides from the VAD state of each uplink frame when the user started and stopped talking.
+ *
+ * Frames before the first speech are held back, so pure silence never reaches the network;
+ * the caller keeps the last pre_roll_ms of them and sends them ahead of the first speech
+ * frame, so the first syllable is not clipped. The utterance ends after end_silence_ms of
+ * silence, provided at least min_speech_ms of speech was heard; shorter bursts are treated
+ * as noise and the endpointer goes back to waiting. A no_speech_timeout_ms of 0 waits forever.
+ *
+ * Frame durations are passed with every call, so it works with any encoder frame size.
+ */
+class VoiceEndpointer {
+public:
+    VoiceEndpointer(int min_speech_ms, int end_silence_ms, int pre_roll_ms, int no_speech_timeout_ms);
+
+    void Reset();
+    EndpointAction Process(bool speech, int frame_ms);
+
+    int pre_roll_ms() const { return pre_roll_ms_; }
+    // Speech heard in the current utterance, 0 when the end was a no speech timeout
+    int speech_ms() const { return speech_ms_; }
+
+private:
+    enum State {
+        kStateWaiting,
+        kStateSpeech,
+        kStateEnded,
+    };
+
+    const int min_speech_ms_;
+    const int end_silence_ms_;
+    const int pre_roll_ms_;
+    const int no_speech_timeout_ms_;
+
+    State state_ = kStateWaiting;
+    int waited_ms_ = 0;
+    int speech_ms_ = 0;
+    int silence_ms_ = 0;
+};
+
+#endif // VOICE_ENDPOINTER_H
@@ -19,6 +19,7 @@ public:
     virtual void Stop() = 0;
     virtual size_t GetFeedSize() = 0;
     virtual void EncodeWakeWordData() = 0;
+    // Blocks for the next encoded packet, its Opus data follows AUDIO_PACKET_HEADROOM free bytes
     virtual bool GetWakeWordOpus(std::vector<uint8_t>& opus) = 0;
     virtual const std::string& GetLastDetectedWakeWord() const = 0;
 };
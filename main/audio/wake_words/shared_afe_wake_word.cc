@@ -0,0 +1,80 @@
+#include "shared_afe_wake_word.h"
+#include "audio_service.h"
+#include "processors/afe_audio_processor.h"
+
+#include <esp_log.h>
+#include <cstring>
+#include <sstream>
+
+#define TAG "SharedAfeWakeWord"
+
+SharedAfeWakeWord::SharedAfeWakeWord(AfeAudioProcessor* processor)
+    : processor_(processor),
+      wake_word_recorder_(4096 * 6) {
+}
+
+bool SharedAfeWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
+    processor_->Initialize(codec, OPUS_FRAME_DURATION_MS, models_list);
+    auto models = processor_->models();
+    if (models == nullptr || models->num == -1) {
+        ESP_LOGE(TAG, "Failed to initialize wakenet model");
+        return false;
+    }
+    for (int i = 0; i < models->num; i++) {
+        if (strstr(models->model_name[i], ESP_WN_PREFIX) != NULL) {
+            auto words = esp_srmodel_get_wake_words(models, models->model_name[i]);
+            // split by ";" to get all wake words
+            std::stringstream ss(words);
+            std::string word;
+            while (std::getline(ss, word, ';')) {
+                wake_words_.push_back(word);
+            }
+        }
+    }
+
+    processor_->OnWakeWordChunk([this](const int16_t* data, size_t samples, int wake_word_index) {
+        // Store the wake word data for voice recognition, like who is speaking
+        wake_word_recorder_.Store(data, samples);
+        if (wake_word_index <= 0 || wake_word_index > (int)wake_words_.size()) {
+            return;
+        }
+        /*
+         * Unlike the standalone wake words, detection stays armed: it costs nothing on the shared
+         * front end and realtime mode never re-enables it, so barge-in keeps working for the whole
+         * session. The application turns it off through EnableWakeWordDetection where needed.
+         */
+        last_detected_wake_word_ = wake_words_[wake_word_index - 1];
+        if (wake_word_detected_callback_) {
+            wake_word_detected_callback_(last_detected_wake_word_);
+        }
+    });
+    return true;
+}
+
+void SharedAfeWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) {
+    wake_word_detected_callback_ = callback;
+}
+
+void SharedAfeWakeWord::Start() {
+    processor_->EnableWakeWord(true);
+}
+
+void SharedAfeWakeWord::Stop() {
+    processor_->EnableWakeWord(false);
+}
+
+void SharedAfeWakeWord::Feed(const std::vector<int16_t>& data) {
+    processor_->FeedChunk(data.data());
+}
+
+size_t SharedAfeWakeWord::GetFeedSize() {
+    return processor_->GetFeedSize();
+}
+
+void SharedAfeWakeWord::EncodeWakeWordData() {
+    wake_word_recorder_.Encode();
+}
+
+bool SharedAfeWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
+    return wake_word_recorder_.GetOpus(opus);
+}
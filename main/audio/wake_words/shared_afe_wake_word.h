@@ -0,0 +1,40 @@
+#ifndef SHARED_AFE_WAKE_WORD_H
+#define SHARED_AFE_WAKE_WORD_H
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "wake_word.h"
+#include "wake_word_recorder.h"
+
+class AfeAudioProcessor;
+
+/*
+ * WakeNet detection on the AFE of the audio processor, instead of an AFE of its own.
+ * Detection can stay on while the processor feeds the encoder, which allows a wake word
+ * to interrupt a reply in realtime mode.
+ */
+class SharedAfeWakeWord : public WakeWord {
+public:
+    SharedAfeWakeWord(AfeAudioProcessor* processor);
+
+    bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
+    void Feed(const std::vector<int16_t>& data);
+    void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
+    void Start();
+    void Stop();
+    size_t GetFeedSize();
+    void EncodeWakeWordData();
+    bool GetWakeWordOpus(std::vector<uint8_t>& opus);
+    const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
+
+private:
+    AfeAudioProcessor* processor_;
+    std::vector<std::string> wake_words_;
+    std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
+    std::string last_detected_wake_word_;
+    WakeWordRecorder wake_word_recorder_;
+};
+
+#endif
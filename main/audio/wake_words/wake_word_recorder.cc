@@ -0,0 +1,159 @@
+#include "wake_word_recorder.h"
+#include "audio_service.h"
+
+#include <algorithm>
+#include <cstring>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+
+#define TAG "WakeWordRecorder"
+
+WakeWordRecorder::WakeWordRecorder(size_t encode_stack_size, int duration_ms)
+    : encode_stack_size_(encode_stack_size) {
+    capacity_ = 16000 / 1000 * duration_ms;
+    pcm_ = (int16_t*)heap_caps_malloc(capacity_ * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (pcm_ == nullptr) {
+        pcm_ = (int16_t*)heap_caps_malloc(capacity_ * sizeof(int16_t), MALLOC_CAP_8BIT);
+    }
+    if (pcm_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u samples of wake word audio", (unsigned)capacity_);
+        capacity_ = 0;
+    }
+}
+
+WakeWordRecorder::~WakeWordRecorder() {
+    if (encode_task_ != nullptr) {
+        vTaskDelete(encode_task_);
+    }
+    if (pcm_ != nullptr) {
+        heap_caps_free(pcm_);
+    }
+    if (encode_task_stack_ != nullptr) {
+        heap_caps_free(encode_task_stack_);
+    }
+    if (encode_task_buffer_ != nullptr) {
+        heap_caps_free(encode_task_buffer_);
+    }
+}
+
+void WakeWordRecorder::Store(const int16_t* data, size_t samples) {
+    if (encoding_ || capacity_ == 0) {
+        return;
+    }
+    // Only the newest samples fit
+    if (samples > capacity_) {
+        data += samples - capacity_;
+        samples = capacity_;
+    }
+    size_t first = std::min(samples, capacity_ - write_);
+    memcpy(pcm_ + write_, data, first * sizeof(int16_t));
+    memcpy(pcm_, data + first, (samples - first) * sizeof(int16_t));
+    write_ = (write_ + samples) % capacity_;
+    size_ = std::min(capacity_, size_ + samples);
+}
+
+void WakeWordRecorder::Encode() {
+    if (encoding_.exchange(true)) {
+        ESP_LOGW(TAG, "Wake word audio is still being encoded");
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& opus : opus_) {
+            AudioFramePool::GetInstance().ReleaseOpus(std::move(opus));
+        }
+        opus_.clear();
+    }
+    if (encode_task_ != nullptr) {
+        xTaskNotifyGive(encode_task_);
+        return;
+    }
+
+    /* The task is never deleted, a new one on the same static buffers could overwrite its TCB */
+    encode_task_stack_ = (StackType_t*)heap_caps_malloc(encode_stack_size_, MALLOC_CAP_SPIRAM);
+    assert(encode_task_stack_ != nullptr);
+    encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
+    assert(encode_task_buffer_ != nullptr);
+    encode_task_ = xTaskCreateStatic([](void* arg) {
+        auto recorder = (WakeWordRecorder*)arg;
+        while (true) {
+            recorder->EncodeTask();
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }, "encode_wake_word", encode_stack_size_, this, 2, encode_task_stack_, encode_task_buffer_);
+}
+
+void WakeWordRecorder::EncodeTask() {
+    auto start_time = esp_timer_get_time();
+    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
+    void* encoder_handle = nullptr;
+    auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder_handle);
+    if (encoder_handle == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+    } else {
+        int frame_size = 0;
+        int outbuf_size = 0;
+        esp_opus_enc_get_frame_size(encoder_handle, &frame_size, &outbuf_size);
+        frame_size = frame_size / sizeof(int16_t);
+
+        /* Frames are copied out of the ring once, the last one may wrap around its end */
+        auto& pool = AudioFramePool::GetInstance();
+        std::vector<int16_t> frame = pool.AcquirePcm();
+        frame.resize(frame_size);
+        size_t read = (write_ + capacity_ - size_) % capacity_;
+        int packets = 0;
+        for (size_t done = 0; done + frame_size <= size_; done += frame_size) {
+            size_t first = std::min<size_t>(frame_size, capacity_ - read);
+            memcpy(frame.data(), pcm_ + read, first * sizeof(int16_t));
+            memcpy(frame.data() + first, pcm_, (frame_size - first) * sizeof(int16_t));
+            read = (read + frame_size) % capacity_;
+
+            std::vector<uint8_t> opus = pool.AcquireOpus();
+            opus.resize(AUDIO_PACKET_HEADROOM + outbuf_size);
+            esp_audio_enc_in_frame_t in = {
+                .buffer = (uint8_t *)(frame.data()),
+                .len = (uint32_t)(frame_size * sizeof(int16_t)),
+            };
+            esp_audio_enc_out_frame_t out = {
+                .buffer = opus.data() + AUDIO_PACKET_HEADROOM,
+                .len = (uint32_t)outbuf_size,
+                .encoded_bytes = 0,
+            };
+            ret = esp_opus_enc_process(encoder_handle, &in, &out);
+            if (ret != ESP_AUDIO_ERR_OK) {
+                ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+                pool.ReleaseOpus(std::move(opus));
+                continue;
+            }
+            opus.resize(AUDIO_PACKET_HEADROOM + out.encoded_bytes);
+            PushOpus(std::move(opus));
+            packets++;
+        }
+        pool.ReleasePcm(std::move(frame));
+        esp_opus_enc_close(encoder_handle);
+        ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", packets,
+            (long)((esp_timer_get_time() - start_time) / 1000));
+    }
+
+    size_ = 0;
+    encoding_ = false;
+    // An empty packet marks the end
+    PushOpus(std::vector<uint8_t>());
+}
+
+void WakeWordRecorder::PushOpus(std::vector<uint8_t>&& opus) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    opus_.push_back(std::move(opus));
+    cv_.notify_all();
+}
+
+bool WakeWordRecorder::GetOpus(std::vector<uint8_t>& opus) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() {
+        return !opus_.empty();
+    });
+    opus.swap(opus_.front());
+    AudioFramePool::GetInstance().ReleaseOpus(std::move(opus_.front()));
+    opus_.pop_front();
+    return !opus.empty();
+}
@@ -0,0 +1,51 @@
+#ifndef WAKE_WORD_RECORDER_H
+#define WAKE_WORD_RECORDER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/*
+ * Keeps the last seconds of 16 kHz wake word audio in one preallocated ring, and encodes them
+ * to Opus on a helper task after a detection. Each packet is handed out as soon as it is
+ * encoded, so the upload can start while the rest is still being encoded.
+ */
+class WakeWordRecorder {
+public:
+    WakeWordRecorder(size_t encode_stack_size, int duration_ms = 2000);
+    ~WakeWordRecorder();
+
+    // Called by the detection task, ignored while the stored audio is being encoded
+    void Store(const int16_t* data, size_t samples);
+    void Encode();
+    // Blocks for the next packet, false after the last one. The Opus data follows
+    // AUDIO_PACKET_HEADROOM free bytes.
+    bool GetOpus(std::vector<uint8_t>& opus);
+
+private:
+    int16_t* pcm_ = nullptr;
+    size_t capacity_ = 0;
+    size_t write_ = 0;
+    size_t size_ = 0;
+    std::atomic<bool> encoding_ = false;
+
+    size_t encode_stack_size_;
+    // Created on the first detection, then waits for a notification per detection
+    TaskHandle_t encode_task_ = nullptr;
+    StaticTask_t* encode_task_buffer_ = nullptr;
+    StackType_t* encode_task_stack_ = nullptr;
+    std::deque<std::vector<uint8_t>> opus_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+
+    void EncodeTask();
+    void PushOpus(std::vector<uint8_t>&& opus);
+};
+
+#endif // WAKE_WORD_RECORDER_H
@@ -1,4 +1,5 @@
 #include "afsk_demod.h"
+#include "pcm_kernels.h"
 #include <cstring>
 #include <algorithm>
 #include "esp_log.h"
@@ -42,11 +43,7 @@ namespace audio_wifi_config
             }
 
             if (input_channels == 2) { // 如果是双声道输入，转换为单声道
-                auto mono_data = std::vector<int16_t>(audio_data.size() / 2);
-                for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                    mono_data[i] = audio_data[j];
-                }
-                audio_data = std::move(mono_data);
+                audio_data.resize(PcmExtractChannel(audio_data.data(), audio_data.data(), audio_data.size() / 2, 2));
             }
             
             // Downsample the audio data
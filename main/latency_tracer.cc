@@ -0,0 +1,238 @@
+#include "latency_tracer.h"
+
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "LatencyTracer"
+
+static const char* const kEventNames[kLatencyEventCount] = {
+    "wake_word",
+    "channel_open",
+    "server_hello",
+    "listen_start",
+    "first_uplink",
+    "voice_end",
+    "stt",
+    "tts_start",
+    "first_packet",
+    "first_output",
+};
+
+const char* LatencyTracer::GetEventName(LatencyEvent event) {
+    return event < kLatencyEventCount ? kEventNames[event] : "unknown";
+}
+
+void LatencyTracer::Record(LatencyEvent event) {
+    if (event >= kLatencyEventCount) {
+        return;
+    }
+    /* Called for every packet and frame: only reply audio counts, and only its first frame */
+    if (event == kLatencyFirstPacket || event == kLatencyFirstOutput) {
+        if (current_[kLatencyTtsStart].load() == 0 || current_[event].load() != 0) {
+            return;
+        }
+    }
+    /* Likewise only the first microphone frame after listen start */
+    if (event == kLatencyFirstUplink) {
+        if (current_[kLatencyListenStart].load() == 0 || current_[event].load() != 0) {
+            return;
+        }
+    }
+    int64_t now = esp_timer_get_time();
+    uint32_t index = event_head_.fetch_add(1, std::memory_order_relaxed) % LATENCY_TRACER_MAX_EVENTS;
+    events_[index].time_us.store(now, std::memory_order_relaxed);
+    events_[index].event.store(event, std::memory_order_release);
+
+    switch (event) {
+    case kLatencyWakeWord:
+        StartTurn();
+        break;
+    case kLatencyChannelOpen:
+        if (current_[kLatencyWakeWord].load() == 0 || current_[kLatencyChannelOpen].load() != 0) {
+            StartTurn();
+        }
+        break;
+    case kLatencyListenStart:
+        /* Continue a turn that is still opening the channel */
+        if ((current_[kLatencyWakeWord].load() == 0 && current_[kLatencyChannelOpen].load() == 0) ||
+            current_[kLatencyListenStart].load() != 0) {
+            StartTurn();
+        }
+        break;
+    case kLatencyVoiceEnd:
+        /* In realtime mode there is no listen start, the next speech end opens the next turn */
+        if (current_[kLatencyFirstOutput].load() != 0) {
+            StartTurn();
+        }
+        /* VAD may toggle several times, the last speech end before the reply counts */
+        if (current_[kLatencyTtsStart].load() == 0) {
+            current_[event].store(now);
+        }
+        return;
+    case kLatencyTtsStart:
+        if (current_[kLatencyFirstOutput].load() != 0) {
+            StartTurn();
+        }
+        break;
+    default:
+        break;
+    }
+
+    int64_t expected = 0;
+    if (current_[event].compare_exchange_strong(expected, now) && event == kLatencyFirstOutput) {
+        FinishTurn();
+    }
+}
+
+void LatencyTracer::StartTurn() {
+    for (auto& time_us : current_) {
+        time_us.store(0);
+    }
+}
+
+void LatencyTracer::FinishTurn() {
+    uint32_t count = turn_count_.load(std::memory_order_relaxed);
+    auto& turn = turns_[count % LATENCY_TRACER_MAX_TURNS];
+    for (int i = 0; i < kLatencyEventCount; i++) {
+        turn.time_us[i] = current_[i].load();
+    }
+    turn_count_.store(count + 1, std::memory_order_release);
+}
+
+// Delay from the previous milestone that happened in this turn, -1 if the milestone is missing
+static int MilestoneDelayMs(const int64_t* time_us, int index) {
+    if (time_us[index] == 0) {
+        return -1;
+    }
+    for (int i = index - 1; i >= 0; i--) {
+        if (time_us[i] != 0) {
+            return (time_us[index] - time_us[i]) / 1000;
+        }
+    }
+    return -1;
+}
+
+// Delay from the first milestone of the turn (from < 0) or from a given milestone
+static int SpanMs(const int64_t* time_us, int from, int to) {
+    if (time_us[to] == 0) {
+        return -1;
+    }
+    if (from < 0) {
+        for (int i = 0; i < to; i++) {
+            if (time_us[i] != 0) {
+                return (time_us[to] - time_us[i]) / 1000;
+            }
+        }
+        return -1;
+    }
+    if (time_us[from] == 0) {
+        return -1;
+    }
+    return (time_us[to] - time_us[from]) / 1000;
+}
+
+int LatencyTracer::Percentile(int from, int to, int percent) {
+    int values[LATENCY_TRACER_MAX_TURNS];
+    int count = 0;
+    uint32_t turns = std::min<uint32_t>(turn_count_.load(std::memory_order_acquire), LATENCY_TRACER_MAX_TURNS);
+    for (uint32_t i = 0; i < turns; i++) {
+        int value = from == to ? MilestoneDelayMs(turns_[i].time_us, to) : SpanMs(turns_[i].time_us, from, to);
+        if (value >= 0) {
+            values[count++] = value;
+        }
+    }
+    if (count == 0) {
+        return -1;
+    }
+    std::sort(values, values + count);
+    return values[(count - 1) * percent / 100];
+}
+
+std::string LatencyTracer::FormatTurn(const Turn& turn) {
+    std::string text;
+    char buffer[48];
+    for (int i = 0; i < kLatencyEventCount; i++) {
+        int delay = MilestoneDelayMs(turn.time_us, i);
+        if (delay >= 0) {
+            snprintf(buffer, sizeof(buffer), " %s+%d", kEventNames[i], delay);
+            text += buffer;
+        }
+    }
+    snprintf(buffer, sizeof(buffer), " | total %d ms", SpanMs(turn.time_us, -1, kLatencyFirstOutput));
+    text += buffer;
+    return text;
+}
+
+void LatencyTracer::PrintNewTurns() {
+    uint32_t count = turn_count_.load(std::memory_order_acquire);
+    if (count == printed_turns_) {
+        return;
+    }
+    if (count - printed_turns_ > LATENCY_TRACER_MAX_TURNS) {
+        printed_turns_ = count - LATENCY_TRACER_MAX_TURNS;
+    }
+    for (; printed_turns_ < count; printed_turns_++) {
+        auto text = FormatTurn(turns_[printed_turns_ % LATENCY_TRACER_MAX_TURNS]);
+        ESP_LOGI(TAG, "Turn %lu:%s", printed_turns_ + 1, text.c_str());
+    }
+    ESP_LOGI(TAG, "Total p50 %d ms p95 %d ms, voice end to first output p50 %d ms p95 %d ms",
+        Percentile(-1, kLatencyFirstOutput, 50), Percentile(-1, kLatencyFirstOutput, 95),
+        Percentile(kLatencyVoiceEnd, kLatencyFirstOutput, 50), Percentile(kLatencyVoiceEnd, kLatencyFirstOutput, 95));
+    ESP_LOGI(TAG, "Wake word to first uplink frame p50 %d ms p95 %d ms",
+        Percentile(kLatencyWakeWord, kLatencyFirstUplink, 50), Percentile(kLatencyWakeWord, kLatencyFirstUplink, 95));
+}
+
+void LatencyTracer::PrintReport() {
+    uint32_t turns = std::min<uint32_t>(turn_count_.load(std::memory_order_acquire), LATENCY_TRACER_MAX_TURNS);
+    ESP_LOGI(TAG, "Latency over the last %lu turns (delay from the previous milestone, ms):", turns);
+    for (int i = 0; i < kLatencyEventCount; i++) {
+        int p50 = Percentile(i, i, 50);
+        if (p50 >= 0) {
+            ESP_LOGI(TAG, "  %-13s p50 %5d p95 %5d", kEventNames[i], p50, Percentile(i, i, 95));
+        }
+    }
+    ESP_LOGI(TAG, "  %-13s p50 %5d p95 %5d", "total", Percentile(-1, kLatencyFirstOutput, 50),
+        Percentile(-1, kLatencyFirstOutput, 95));
+
+    uint32_t head = event_head_.load(std::memory_order_acquire);
+    uint32_t first = head > LATENCY_TRACER_MAX_EVENTS ? head - LATENCY_TRACER_MAX_EVENTS : 0;
+    for (uint32_t i = first; i < head; i++) {
+        auto& event = events_[i % LATENCY_TRACER_MAX_EVENTS];
+        ESP_LOGI(TAG, "  %lld us %s", event.time_us.load(), GetEventName((LatencyEvent)event.event.load()));
+    }
+}
+
+cJSON* LatencyTracer::GetReportJson() {
+    uint32_t count = turn_count_.load(std::memory_order_acquire);
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "turns", count);
+
+    if (count > 0) {
+        auto& last = turns_[(count - 1) % LATENCY_TRACER_MAX_TURNS];
+        cJSON* last_turn = cJSON_CreateObject();
+        for (int i = 0; i < kLatencyEventCount; i++) {
+            int delay = MilestoneDelayMs(last.time_us, i);
+            if (delay >= 0) {
+                cJSON_AddNumberToObject(last_turn, kEventNames[i], delay);
+            }
+        }
+        cJSON_AddNumberToObject(last_turn, "total", SpanMs(last.time_us, -1, kLatencyFirstOutput));
+        cJSON_AddItemToObject(root, "last_turn_ms", last_turn);
+    }
+
+    for (int percent : {50, 95}) {
+        cJSON* stats = cJSON_CreateObject();
+        for (int i = 0; i < kLatencyEventCount; i++) {
+            int value = Percentile(i, i, percent);
+            if (value >= 0) {
+                cJSON_AddNumberToObject(stats, kEventNames[i], value);
+            }
+        }
+        cJSON_AddNumberToObject(stats, "total", Percentile(-1, kLatencyFirstOutput, percent));
+        cJSON_AddNumberToObject(stats, "voice_end_to_output", Percentile(kLatencyVoiceEnd, kLatencyFirstOutput, percent));
+        cJSON_AddNumberToObject(stats, "wake_to_uplink", Percentile(kLatencyWakeWord, kLatencyFirstUplink, percent));
+        cJSON_AddItemToObject(root, percent == 50 ? "p50_ms" : "p95_ms", stats);
+    }
+    return root;
+}
@@ -0,0 +1,83 @@
+#ifndef _LATENCY_TRACER_H_
+#define _LATENCY_TRACER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include <cJSON.h>
+
+#define LATENCY_TRACER_MAX_EVENTS 64
+#define LATENCY_TRACER_MAX_TURNS 32
+
+// Milestones of one voice turn, in the order they normally happen
+enum LatencyEvent : uint8_t {
+    kLatencyWakeWord,           // Wake word detected
+    kLatencyChannelOpen,        // OpenAudioChannel called
+    kLatencyServerHello,        // Server hello received
+    kLatencyListenStart,        // listen start sent
+    kLatencyFirstUplink,        // First encoded microphone frame queued for sending
+    kLatencyVoiceEnd,           // Last VAD speech end (or listen stop) before the reply
+    kLatencyStt,                // stt text received
+    kLatencyTtsStart,           // tts start received
+    kLatencyFirstPacket,        // First reply packet pushed to the decode queue
+    kLatencyFirstOutput,        // First reply samples written to the codec
+    kLatencyEventCount,
+};
+
+/*
+ * Timestamps the user-perceived latency chain of every voice turn.
+ *
+ * Record() only does atomic stores into preallocated arrays, so it can be called from the
+ * audio tasks. A turn starts at the wake word, or at listen start once the previous turn
+ * finished, and is complete when its first reply sample reaches the codec.
+ */
+class LatencyTracer {
+public:
+    static LatencyTracer& GetInstance() {
+        static LatencyTracer instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    LatencyTracer(const LatencyTracer&) = delete;
+    LatencyTracer& operator=(const LatencyTracer&) = delete;
+
+    void Record(LatencyEvent event);
+
+    // Logs the turns completed since the last call, for the clock tick in the main loop
+    void PrintNewTurns();
+    void PrintReport();
+    // Caller owns the returned object
+    cJSON* GetReportJson();
+
+    static const char* GetEventName(LatencyEvent event);
+
+private:
+    LatencyTracer() = default;
+    ~LatencyTracer() = default;
+
+    struct Event {
+        std::atomic<int64_t> time_us{0};
+        std::atomic<uint8_t> event{kLatencyEventCount};
+    };
+    // Milestone times of a completed turn, 0 when the milestone did not happen
+    struct Turn {
+        int64_t time_us[kLatencyEventCount];
+    };
+
+    Event events_[LATENCY_TRACER_MAX_EVENTS];
+    std::atomic<uint32_t> event_head_{0};
+
+    std::atomic<int64_t> current_[kLatencyEventCount] = {};
+    Turn turns_[LATENCY_TRACER_MAX_TURNS] = {};
+    std::atomic<uint32_t> turn_count_{0};
+    uint32_t printed_turns_ = 0;
+
+    void StartTurn();
+    void FinishTurn();
+    // Percentile of the milestone-to-milestone delay over the stored turns, -1 if never seen
+    int Percentile(int from, int to, int percent);
+    std::string FormatTurn(const Turn& turn);
+};
+
+#endif // _LATENCY_TRACER_H_
@@ -0,0 +1,95 @@
+#include "main_task_queue.h"
+
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "MainTaskQueue"
+
+static const char* const kPriorityNames[kMainTaskPriorityCount] = {
+    "state",
+    "audio",
+    "ui",
+    "background",
+};
+
+const char* MainTaskQueue::GetPriorityName(MainTaskPriority priority) {
+    return priority < kMainTaskPriorityCount ? kPriorityNames[priority] : "unknown";
+}
+
+void MainTaskQueue::Push(MainTask&& task, MainTaskPriority priority, const char* name) {
+    if (priority >= kMainTaskPriorityCount) {
+        priority = kMainTaskBackground;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (task.on_heap()) {
+        statistics_[priority].heap_captures++;
+    }
+    queues_[priority].push_back(Entry{std::move(task), name});
+    size_++;
+}
+
+bool MainTaskQueue::PopHighest(Entry& entry, MainTaskPriority& priority) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < kMainTaskPriorityCount; i++) {
+        if (!queues_[i].empty()) {
+            entry = std::move(queues_[i].front());
+            queues_[i].pop_front();
+            size_--;
+            priority = (MainTaskPriority)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t MainTaskQueue::RunPending() {
+    /* Tasks scheduled by the tasks run here wait for the next round, so the loop always ends */
+    size_t pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending = size_;
+    }
+
+    size_t count = 0;
+    Entry entry{MainTask(), nullptr};
+    MainTaskPriority priority;
+    while (count < pending && PopHighest(entry, priority)) {
+        int64_t start_time = esp_timer_get_time();
+        entry.task();
+        uint32_t elapsed_us = esp_timer_get_time() - start_time;
+        /* Release the captures before the next task runs */
+        entry.task = MainTask();
+        count++;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& statistics = statistics_[priority];
+        statistics.count++;
+        statistics.total_us += elapsed_us;
+        statistics.max_us = std::max(statistics.max_us, elapsed_us);
+        if (elapsed_us > MAIN_TASK_BUDGET_MS * 1000) {
+            statistics.over_budget++;
+            ESP_LOGW(TAG, "%s task %s took %lu ms", kPriorityNames[priority],
+                entry.name != nullptr ? entry.name : "(unnamed)", elapsed_us / 1000);
+        }
+    }
+    return count;
+}
+
+MainTaskStatistics MainTaskQueue::statistics(MainTaskPriority priority) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return priority < kMainTaskPriorityCount ? statistics_[priority] : MainTaskStatistics();
+}
+
+void MainTaskQueue::PrintStatistics() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < kMainTaskPriorityCount; i++) {
+        auto& statistics = statistics_[i];
+        if (statistics.count == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-10s %lu tasks, avg %llu us, max %lu us, %lu over budget, %lu heap captures",
+            kPriorityNames[i], statistics.count, statistics.total_us / statistics.count, statistics.max_us,
+            statistics.over_budget, statistics.heap_captures);
+    }
+}
@@ -0,0 +1,154 @@
+#ifndef _MAIN_TASK_QUEUE_H_
+#define _MAIN_TASK_QUEUE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Captures up to this size are stored in the task itself, larger ones on the heap
+#define MAIN_TASK_INLINE_SIZE 48
+// A task running longer than this blocks the main loop noticeably and is logged
+#define MAIN_TASK_BUDGET_MS 50
+
+// Run order of scheduled tasks, highest first; FIFO within a priority
+enum MainTaskPriority : uint8_t {
+    kMainTaskState,         // Device state transitions, channel open / close
+    kMainTaskAudio,         // Listening and speaking control, aborts
+    kMainTaskUi,            // Display and chat text updates
+    kMainTaskBackground,    // MCP tool calls, upgrades, reconnects
+    kMainTaskPriorityCount,
+};
+
+/*
+ * Move-only void() callable for the main task queue. Unlike std::function, lambdas with a
+ * few captures (this, a pointer and a string) are stored inline without a heap allocation.
+ */
+class MainTask {
+public:
+    MainTask() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, MainTask>>>
+    MainTask(F&& callable) {
+        using T = std::decay_t<F>;
+        if constexpr (sizeof(T) <= MAIN_TASK_INLINE_SIZE && alignof(T) <= alignof(std::max_align_t) &&
+            std::is_nothrow_move_constructible_v<T>) {
+            new (storage_) T(std::forward<F>(callable));
+            ops_ = InlineOps<T>();
+        } else {
+            *reinterpret_cast<T**>(storage_) = new T(std::forward<F>(callable));
+            ops_ = HeapOps<T>();
+        }
+    }
+
+    MainTask(MainTask&& other) noexcept { MoveFrom(other); }
+    MainTask& operator=(MainTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+    MainTask(const MainTask&) = delete;
+    MainTask& operator=(const MainTask&) = delete;
+    ~MainTask() { Reset(); }
+
+    void operator()() { ops_->invoke(storage_); }
+    explicit operator bool() const { return ops_ != nullptr; }
+    bool on_heap() const { return ops_ != nullptr && ops_->heap; }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* to, void* from);
+        void (*destroy)(void* storage);
+        bool heap;
+    };
+
+    alignas(std::max_align_t) unsigned char storage_[MAIN_TASK_INLINE_SIZE];
+    const Ops* ops_ = nullptr;
+
+    template <typename T>
+    static const Ops* InlineOps() {
+        static const Ops ops = {
+            [](void* storage) { (*static_cast<T*>(storage))(); },
+            [](void* to, void* from) {
+                new (to) T(std::move(*static_cast<T*>(from)));
+                static_cast<T*>(from)->~T();
+            },
+            [](void* storage) { static_cast<T*>(storage)->~T(); },
+            false,
+        };
+        return &ops;
+    }
+
+    template <typename T>
+    static const Ops* HeapOps() {
+        static const Ops ops = {
+            [](void* storage) { (**static_cast<T**>(storage))(); },
+            [](void* to, void* from) { *static_cast<T**>(to) = *static_cast<T**>(from); },
+            [](void* storage) { delete *static_cast<T**>(storage); },
+            true,
+        };
+        return &ops;
+    }
+
+    void MoveFrom(MainTask& other) {
+        ops_ = other.ops_;
+        if (ops_ != nullptr) {
+            ops_->move(storage_, other.storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    void Reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+};
+
+struct MainTaskStatistics {
+    uint32_t count = 0;
+    uint32_t over_budget = 0;
+    uint32_t heap_captures = 0;    // Tasks whose captures did not fit inline
+    uint32_t max_us = 0;
+    uint64_t total_us = 0;
+};
+
+/*
+ * Run queue of the Application main loop. Push() may be called from any task; RunPending()
+ * runs on the main task, one task at a time and always the highest priority one first, so a
+ * state change scheduled while a long UI or MCP batch is pending does not wait behind it.
+ * Every task is timed and the time is accounted to its priority.
+ */
+class MainTaskQueue {
+public:
+    void Push(MainTask&& task, MainTaskPriority priority, const char* name);
+    // Runs as many tasks as were queued on entry, returns how many ran
+    size_t RunPending();
+
+    MainTaskStatistics statistics(MainTaskPriority priority) const;
+    void PrintStatistics() const;
+
+    static const char* GetPriorityName(MainTaskPriority priority);
+
+private:
+    struct Entry {
+        MainTask task;
+        const char* name;
+    };
+
+    mutable std::mutex mutex_;
+    std::deque<Entry> queues_[kMainTaskPriorityCount];
+    size_t size_ = 0;
+    MainTaskStatistics statistics_[kMainTaskPriorityCount];
+
+    bool PopHighest(Entry& entry, MainTaskPriority& priority);
+};
+
+#endif // _MAIN_TASK_QUEUE_H_
@@ -15,12 +15,15 @@
 #include "oled_display.h"
 #include "board.h"
 #include "settings.h"
+#include "latency_tracer.h"
 #include "lvgl_theme.h"
 #include "lvgl_display.h"
 
 #define TAG "MCP"
 
-McpServer::McpServer() {
+McpServer::McpServer()
+    : tool_runner_([this](int id, std::shared_ptr<TextSource> result) { ReplyResult(id, std::move(result)); },
+                   [this](int id, const std::string& message) { ReplyError(id, message); }) {
 }
 
 McpServer::~McpServer() {
@@ -37,6 +40,7 @@ void McpServer::AddCommonTools() {
 
     // Backup the original tools list and restore it after adding the common tools.
     auto original_tools = std::move(tools_);
+    tool_index_.clear();
     auto& board = Board::GetInstance();
 
     // Do not add custom tools here.
@@ -117,12 +121,13 @@ void McpServer::AddCommonTools() {
                 }
                 auto question = properties["question"].value<std::string>();
                 return camera->Explain(question);
-            });
+            })->set_blocking(true);
     }
 #endif
 
     // Restore the original tools list to the end of the tools list
     tools_.insert(tools_.end(), original_tools.begin(), original_tools.end());
+    RebuildToolIndex();
 }
 
 void McpServer::AddUserOnlyTools() {
@@ -135,6 +140,16 @@ void McpServer::AddUserOnlyTools() {
             return board.GetSystemInfoJson();
         });
 
+    AddUserOnlyTool("self.get_latency_report",
+        "Get the voice latency of the recent turns, from wake word / listen start to the first reply sample. "
+        "Reports the last turn and the p50/p95 delay of every milestone in milliseconds, and dumps the event log to the serial console.",
+        PropertyList(),
+        [this](const PropertyList& properties) -> ReturnValue {
+            auto& tracer = LatencyTracer::GetInstance();
+            tracer.PrintReport();
+            return tracer.GetReportJson();
+        });
+
     AddUserOnlyTool("self.reboot", "Reboot the system",
         PropertyList(),
         [this](const PropertyList& properties) -> ReturnValue {
@@ -144,7 +159,7 @@ void McpServer::AddUserOnlyTools() {
                 vTaskDelay(pdMS_TO_TICKS(1000));
 
                 app.Reboot();
-            });
+            }, kMainTaskBackground, "reboot");
             return true;
         });
 
@@ -163,7 +178,7 @@ void McpServer::AddUserOnlyTools() {
                 if (!success) {
                     ESP_LOGE(TAG, "Firmware upgrade failed");
                 }
-            });
+            }, kMainTaskBackground, "upgrade");
             
             return true;
         });
@@ -201,6 +216,9 @@ void McpServer::AddUserOnlyTools() {
                     throw std::runtime_error("Failed to snapshot screen");
                 }
 
+                if (McpToolRunner::IsCancelled()) {
+                    throw std::runtime_error("Snapshot cancelled");
+                }
                 ESP_LOGI(TAG, "Upload snapshot %u bytes to %s", jpeg_data.size(), url.c_str());
                 
                 // 构造multipart/form-data请求体
@@ -239,7 +257,7 @@ void McpServer::AddUserOnlyTools() {
                 http->Close();
                 ESP_LOGI(TAG, "Snapshot screen result: %s", result.c_str());
                 return true;
-            });
+            })->set_blocking(true);
         
         AddUserOnlyTool("self.screen.preview_image", "Preview an image on the screen",
             PropertyList({
@@ -264,6 +282,10 @@ void McpServer::AddUserOnlyTools() {
                 }
                 size_t total_read = 0;
                 while (total_read < content_length) {
+                    if (McpToolRunner::IsCancelled()) {
+                        heap_caps_free(data);
+                        throw std::runtime_error("Download cancelled: " + url);
+                    }
                     int ret = http->Read(data + total_read, content_length - total_read);
                     if (ret < 0) {
                         heap_caps_free(data);
@@ -279,7 +301,7 @@ void McpServer::AddUserOnlyTools() {
                 auto image = std::make_unique<LvglAllocatedImage>(data, content_length);
                 display->SetPreviewImage(std::move(image));
                 return true;
-            });
+            })->set_blocking(true);
 #endif // CONFIG_LV_USE_SNAPSHOT
     }
 #endif // HAVE_LVGL
@@ -300,25 +322,37 @@ void McpServer::AddUserOnlyTools() {
     }
 }
 
-void McpServer::AddTool(McpTool* tool) {
-    // Prevent adding duplicate tools
-    if (std::find_if(tools_.begin(), tools_.end(), [tool](const McpTool* t) { return t->name() == tool->name(); }) != tools_.end()) {
+McpTool* McpServer::AddTool(McpTool* tool) {
+    // Prevent adding duplicate tools, the caller gets the registered one to chain setters on
+    auto index = tool_index_.find(tool->name());
+    if (index != tool_index_.end()) {
         ESP_LOGW(TAG, "Tool %s already added", tool->name().c_str());
-        return;
+        delete tool;
+        return tools_[index->second];
     }
 
     ESP_LOGI(TAG, "Add tool: %s%s", tool->name().c_str(), tool->user_only() ? " [user]" : "");
+    tool_index_.emplace(tool->name(), tools_.size());
     tools_.push_back(tool);
+    return tool;
+}
+
+void McpServer::RebuildToolIndex() {
+    tool_index_.clear();
+    tool_index_.reserve(tools_.size());
+    for (size_t i = 0; i < tools_.size(); i++) {
+        tool_index_.emplace(tools_[i]->name(), i);
+    }
 }
 
-void McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
-    AddTool(new McpTool(name, description, properties, callback));
+McpTool* McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
+    return AddTool(new McpTool(name, description, properties, callback));
 }
 
-void McpServer::AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
+McpTool* McpServer::AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
     auto tool = new McpTool(name, description, properties, callback);
     tool->set_user_only(true);
-    AddTool(tool);
+    return AddTool(tool);
 }
 
 void McpServer::ParseMessage(const std::string& message) {
@@ -366,6 +400,14 @@ void McpServer::ParseMessage(const cJSON* json) {
     }
     
     auto method_str = std::string(method->valuestring);
+    if (method_str == "notifications/cancelled") {
+        auto params = cJSON_GetObjectItem(json, "params");
+        auto request_id = cJSON_GetObjectItem(params, "requestId");
+        if (cJSON_IsNumber(request_id)) {
+            tool_runner_.Cancel(request_id->valueint);
+        }
+        return;
+    }
     if (method_str.find("notifications") == 0) {
         return;
     }
@@ -443,6 +485,11 @@ void McpServer::ReplyResult(int id, const std::string& result) {
     Application::GetInstance().SendMcpMessage(payload);
 }
 
+void McpServer::ReplyResult(int id, std::shared_ptr<TextSource> result) {
+    std::string prefix = "{\"jsonrpc\":\"2.0\",\"id\":" + std::to_string(id) + ",\"result\":";
+    Application::GetInstance().SendMcpMessage(std::make_shared<WrappedTextSource>(std::move(prefix), std::move(result), "}"));
+}
+
 void McpServer::ReplyError(int id, const std::string& message) {
     std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
     payload += std::to_string(id);
@@ -453,46 +500,46 @@ void McpServer::ReplyError(int id, const std::string& message) {
 }
 
 void McpServer::GetToolsList(int id, const std::string& cursor, bool list_user_only_tools) {
-    const int max_payload_size = 8000;
-    std::string json = "{\"tools\":[";
-    
-    bool found_cursor = cursor.empty();
-    auto it = tools_.begin();
-    std::string next_cursor = "";
-    
-    while (it != tools_.end()) {
-        // 如果我们还没有找到起始位置，继续搜索
-        if (!found_cursor) {
-            if ((*it)->name() == cursor) {
-                found_cursor = true;
-            } else {
-                ++it;
-                continue;
-            }
+    const size_t max_payload_size = 8000;
+
+    // The cursor is the name of the first tool of the page
+    size_t start = 0;
+    if (!cursor.empty()) {
+        auto index = tool_index_.find(cursor);
+        if (index == tool_index_.end()) {
+            ESP_LOGE(TAG, "tools/list: Invalid cursor: %s", cursor.c_str());
+            ReplyError(id, "Invalid cursor: " + cursor);
+            return;
         }
+        start = index->second;
+    }
 
-        if (!list_user_only_tools && (*it)->user_only()) {
-            ++it;
+    std::string json;
+    json.reserve(max_payload_size);
+    json = "{\"tools\":[";
+    std::string next_cursor;
+    for (size_t i = start; i < tools_.size(); i++) {
+        auto tool = tools_[i];
+        if (!list_user_only_tools && tool->user_only()) {
             continue;
         }
-        
+
         // 添加tool前检查大小
-        std::string tool_json = (*it)->to_json() + ",";
-        if (json.length() + tool_json.length() + 30 > max_payload_size) {
+        auto& tool_json = tool->json();
+        if (json.length() + tool_json.length() + 31 > max_payload_size) {
             // 如果添加这个tool会超出大小限制，设置next_cursor并退出循环
-            next_cursor = (*it)->name();
+            next_cursor = tool->name();
             break;
         }
-        
         json += tool_json;
-        ++it;
+        json += ',';
     }
-    
+
     if (json.back() == ',') {
         json.pop_back();
     }
-    
-    if (json.back() == '[' && !tools_.empty()) {
+
+    if (json.back() == '[' && !next_cursor.empty()) {
         // 如果没有添加任何tool，返回错误
         ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", next_cursor.c_str());
         ReplyError(id, "Failed to add tool " + next_cursor + " because of payload size limit");
@@ -504,23 +551,20 @@ void McpServer::GetToolsList(int id, const std::string& cursor, bool list_user_o
     } else {
         json += "],\"nextCursor\":\"" + next_cursor + "\"}";
     }
-    
+
     ReplyResult(id, json);
 }
 
 void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments) {
-    auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
-                                 [&tool_name](const McpTool* tool) { 
-                                     return tool->name() == tool_name; 
-                                 });
-    
-    if (tool_iter == tools_.end()) {
+    auto index = tool_index_.find(tool_name);
+    if (index == tool_index_.end()) {
         ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
         ReplyError(id, "Unknown tool: " + tool_name);
         return;
     }
+    McpTool* tool = tools_[index->second];
 
-    PropertyList arguments = (*tool_iter)->properties();
+    PropertyList arguments = tool->properties();
     try {
         for (auto& argument : arguments) {
             bool found = false;
@@ -550,14 +594,22 @@ void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* to
         return;
     }
 
+    if (tool->blocking()) {
+        tool_runner_.Submit(id, tool->name(), tool->max_concurrency(), tool->timeout_ms(),
+            [tool, arguments = std::move(arguments)]() {
+                return tool->Call(arguments);
+            });
+        return;
+    }
+
     // Use main thread to call the tool
     auto& app = Application::GetInstance();
-    app.Schedule([this, id, tool_iter, arguments = std::move(arguments)]() {
+    app.Schedule([this, id, tool, arguments = std::move(arguments)]() {
         try {
-            ReplyResult(id, (*tool_iter)->Call(arguments));
+            ReplyResult(id, tool->Call(arguments));
         } catch (const std::exception& e) {
             ESP_LOGE(TAG, "tools/call: %s", e.what());
             ReplyError(id, e.what());
         }
-    });
+    }, kMainTaskBackground, "tool_call");
 }
@@ -4,18 +4,24 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <functional>
 #include <variant>
 #include <optional>
 #include <stdexcept>
 #include <thread>
+#include <memory>
+#include <algorithm>
+#include <cstring>
 #include <mbedtls/base64.h>
 
 #include <cJSON.h>
 
+#include "mcp_tool_runner.h"
+
 class ImageContent {
 private:
-    std::string encoded_data_;
+    std::string data_;
     std::string mime_type_;
 
     static std::string Base64Encode(const std::string& data) {
@@ -23,21 +29,23 @@ private:
         mbedtls_base64_encode((unsigned char*)nullptr, 0, &dlen, (const unsigned char*)data.data(), data.size());
         std::string result(dlen, 0);
         mbedtls_base64_encode((unsigned char*)result.data(), result.size(), &olen, (const unsigned char*)data.data(), data.size());
+        result.resize(olen);
         return result;
     }
 
 public:
-    ImageContent(const std::string& mime_type, const std::string& data) {
-        mime_type_ = mime_type;
-        // base64 encode data
-        encoded_data_ = Base64Encode(data);
-    }
+    // The data is kept raw, tool results encode it while sending
+    ImageContent(const std::string& mime_type, std::string data)
+        : data_(std::move(data)), mime_type_(mime_type) {}
+
+    inline const std::string& mime_type() const { return mime_type_; }
+    std::string ReleaseData() { return std::move(data_); }
 
     std::string to_json() const {
         cJSON *json = cJSON_CreateObject();
         cJSON_AddStringToObject(json, "type", "image");
         cJSON_AddStringToObject(json, "mimeType", mime_type_.c_str());
-        cJSON_AddStringToObject(json, "data", encoded_data_.c_str());
+        cJSON_AddStringToObject(json, "data", Base64Encode(data_).c_str());
         char* json_str = cJSON_PrintUnformatted(json);
         std::string result(json_str);
         cJSON_free(json_str);
@@ -46,6 +54,44 @@ public:
     }
 };
 
+// Base64 of binary data, encoded a few hundred bytes at a time as the reader asks for it
+class Base64TextSource : public TextSource {
+private:
+    // 3 input bytes become 4 characters, mbedtls also writes a terminating NUL
+    static constexpr size_t kInputBlock = 384;
+    std::string data_;
+    size_t input_offset_ = 0;
+    unsigned char encoded_[kInputBlock / 3 * 4 + 1];
+    size_t encoded_length_ = 0;
+    size_t encoded_offset_ = 0;
+
+public:
+    explicit Base64TextSource(std::string data) : data_(std::move(data)) {}
+
+    size_t length() const override { return (data_.size() + 2) / 3 * 4; }
+
+    size_t Read(char* buffer, size_t size) override {
+        size_t total = 0;
+        while (total < size) {
+            if (encoded_offset_ == encoded_length_) {
+                if (input_offset_ == data_.size()) {
+                    break;
+                }
+                size_t input = std::min(kInputBlock, data_.size() - input_offset_);
+                mbedtls_base64_encode(encoded_, sizeof(encoded_), &encoded_length_,
+                    (const unsigned char*)data_.data() + input_offset_, input);
+                input_offset_ += input;
+                encoded_offset_ = 0;
+            }
+            size_t n = std::min(size - total, encoded_length_ - encoded_offset_);
+            memcpy(buffer + total, encoded_ + encoded_offset_, n);
+            encoded_offset_ += n;
+            total += n;
+        }
+        return total;
+    }
+};
+
 // 添加类型别名
 using ReturnValue = std::variant<bool, int, std::string, cJSON*, ImageContent*>;
 
@@ -212,6 +258,11 @@ private:
     PropertyList properties_;
     std::function<ReturnValue(const PropertyList&)> callback_;
     bool user_only_ = false;
+    bool blocking_ = false;
+    int max_concurrency_ = 1;
+    int timeout_ms_ = CONFIG_MCP_TOOL_TIMEOUT_MS;
+    // to_json() of the tool, built on first use
+    mutable std::string json_;
 
 public:
     McpTool(const std::string& name, 
@@ -223,11 +274,31 @@ public:
         properties_(properties), 
         callback_(callback) {}
 
-    void set_user_only(bool user_only) { user_only_ = user_only; }
+    void set_user_only(bool user_only) {
+        user_only_ = user_only;
+        json_.clear();
+    }
+    // Blocking tools (network, camera, encoding) run on the tool workers instead of the main loop
+    void set_blocking(bool blocking, int max_concurrency = 1, int timeout_ms = CONFIG_MCP_TOOL_TIMEOUT_MS) {
+        blocking_ = blocking;
+        max_concurrency_ = max_concurrency;
+        timeout_ms_ = timeout_ms;
+    }
     inline const std::string& name() const { return name_; }
     inline const std::string& description() const { return description_; }
     inline const PropertyList& properties() const { return properties_; }
     inline bool user_only() const { return user_only_; }
+    inline bool blocking() const { return blocking_; }
+    inline int max_concurrency() const { return max_concurrency_; }
+    inline int timeout_ms() const { return timeout_ms_; }
+
+    // The schema never changes after registration, so tools/list pages are assembled from this copy
+    const std::string& json() const {
+        if (json_.empty()) {
+            json_ = to_json();
+        }
+        return json_;
+    }
 
     std::string to_json() const {
         std::vector<std::string> required = properties_.GetRequired();
@@ -269,37 +340,41 @@ public:
         return result;
     }
 
-    std::string Call(const PropertyList& properties) {
+    // Returns the tools/call result, image results are streamed instead of built in memory
+    std::shared_ptr<TextSource> Call(const PropertyList& properties) {
         ReturnValue return_value = callback_(properties);
+        if (std::holds_alternative<ImageContent*>(return_value)) {
+            std::unique_ptr<ImageContent> image_content(std::get<ImageContent*>(return_value));
+            // The image item is embedded as a JSON string:
+            // {"content":[{"type":"image","image":"{\"type\":\"image\",\"mimeType\":\"...\",\"data\":\"<base64>\"}"}],"isError":false}
+            std::string prefix = "{\"content\":[{\"type\":\"image\",\"image\":\"{\\\"type\\\":\\\"image\\\",\\\"mimeType\\\":\\\"";
+            prefix += image_content->mime_type();
+            prefix += "\\\",\\\"data\\\":\\\"";
+            return std::make_shared<WrappedTextSource>(std::move(prefix),
+                std::make_shared<Base64TextSource>(image_content->ReleaseData()),
+                "\\\"}\"}],\"isError\":false}");
+        }
+
         // 返回结果
         cJSON* result = cJSON_CreateObject();
         cJSON* content = cJSON_CreateArray();
 
-        if (std::holds_alternative<ImageContent*>(return_value)) {
-            auto image_content = std::get<ImageContent*>(return_value);
-            cJSON* image = cJSON_CreateObject();
-            cJSON_AddStringToObject(image, "type", "image");
-            cJSON_AddStringToObject(image, "image", image_content->to_json().c_str());
-            cJSON_AddItemToArray(content, image);
-            delete image_content;
-        } else {
-            cJSON* text = cJSON_CreateObject();
-            cJSON_AddStringToObject(text, "type", "text");
-            if (std::holds_alternative<std::string>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::get<std::string>(return_value).c_str());
-            } else if (std::holds_alternative<bool>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::get<bool>(return_value) ? "true" : "false");
-            } else if (std::holds_alternative<int>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::to_string(std::get<int>(return_value)).c_str());
-            } else if (std::holds_alternative<cJSON*>(return_value)) {
-                cJSON* json = std::get<cJSON*>(return_value);
-                char* json_str = cJSON_PrintUnformatted(json);
-                cJSON_AddStringToObject(text, "text", json_str);
-                cJSON_free(json_str);
-                cJSON_Delete(json);
-            }
-            cJSON_AddItemToArray(content, text);
+        cJSON* text = cJSON_CreateObject();
+        cJSON_AddStringToObject(text, "type", "text");
+        if (std::holds_alternative<std::string>(return_value)) {
+            cJSON_AddStringToObject(text, "text", std::get<std::string>(return_value).c_str());
+        } else if (std::holds_alternative<bool>(return_value)) {
+            cJSON_AddStringToObject(text, "text", std::get<bool>(return_value) ? "true" : "false");
+        } else if (std::holds_alternative<int>(return_value)) {
+            cJSON_AddStringToObject(text, "text", std::to_string(std::get<int>(return_value)).c_str());
+        } else if (std::holds_alternative<cJSON*>(return_value)) {
+            cJSON* json = std::get<cJSON*>(return_value);
+            char* json_str = cJSON_PrintUnformatted(json);
+            cJSON_AddStringToObject(text, "text", json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
         }
+        cJSON_AddItemToArray(content, text);
         cJSON_AddItemToObject(result, "content", content);
         cJSON_AddBoolToObject(result, "isError", false);
 
@@ -307,7 +382,7 @@ public:
         std::string result_str(json_str);
         cJSON_free(json_str);
         cJSON_Delete(result);
-        return result_str;
+        return std::make_shared<StringTextSource>(std::move(result_str));
     }
 };
 
@@ -320,9 +395,9 @@ public:
 
     void AddCommonTools();
     void AddUserOnlyTools();
-    void AddTool(McpTool* tool);
-    void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
-    void AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
+    McpTool* AddTool(McpTool* tool);
+    McpTool* AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
+    McpTool* AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
     void ParseMessage(const cJSON* json);
     void ParseMessage(const std::string& message);
 
@@ -333,12 +408,17 @@ private:
     void ParseCapabilities(const cJSON* capabilities);
 
     void ReplyResult(int id, const std::string& result);
+    void ReplyResult(int id, std::shared_ptr<TextSource> result);
     void ReplyError(int id, const std::string& message);
 
     void GetToolsList(int id, const std::string& cursor, bool list_user_only_tools);
     void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments);
+    void RebuildToolIndex();
 
     std::vector<McpTool*> tools_;
+    // Tool name to its position in tools_
+    std::unordered_map<std::string, size_t> tool_index_;
+    McpToolRunner tool_runner_;
 };
 
 #endif // MCP_SERVER_H
@@ -0,0 +1,195 @@
+#include "mcp_tool_runner.h"
+
+#include <algorithm>
+#include <esp_log.h>
+
+#define TAG "McpToolRunner"
+
+// The call the current worker task is running, for IsCancelled()
+static thread_local McpToolCall* current_call = nullptr;
+
+McpToolRunner::McpToolRunner(ResultHandler on_result, ErrorHandler on_error)
+    : on_result_(std::move(on_result)), on_error_(std::move(on_error)) {
+}
+
+McpToolRunner::~McpToolRunner() {
+    if (timeout_timer_ != nullptr) {
+        esp_timer_stop(timeout_timer_);
+        esp_timer_delete(timeout_timer_);
+    }
+}
+
+void McpToolRunner::StartWorkers() {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            McpToolRunner* runner = (McpToolRunner*)arg;
+            runner->CheckTimeouts();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "mcp_tool_timeout",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&timer_args, &timeout_timer_);
+
+    /* Low priority, a tool call must never delay audio or the main loop */
+    for (int i = 0; i < CONFIG_MCP_TOOL_WORKERS; i++) {
+        TaskHandle_t handle = nullptr;
+        xTaskCreate([](void* arg) {
+            McpToolRunner* runner = (McpToolRunner*)arg;
+            runner->WorkerTask();
+            vTaskDelete(NULL);
+        }, "mcp_tool", CONFIG_MCP_TOOL_STACK_SIZE, this, 2, &handle);
+        workers_.push_back(handle);
+    }
+    ESP_LOGI(TAG, "Started %d tool workers", CONFIG_MCP_TOOL_WORKERS);
+}
+
+void McpToolRunner::Submit(int id, const std::string& name, int max_concurrency, int timeout_ms, std::function<std::shared_ptr<TextSource>()> call) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (workers_.empty()) {
+        StartWorkers();
+    }
+
+    auto& active = active_calls_[name];
+    if (active >= max_concurrency) {
+        ESP_LOGW(TAG, "Tool %s is busy, %d calls in progress", name.c_str(), active);
+        lock.unlock();
+        on_error_(id, "Tool " + name + " is busy");
+        return;
+    }
+    if (queue_.size() >= MCP_TOOL_MAX_QUEUED) {
+        ESP_LOGW(TAG, "Too many queued tool calls, rejecting %s", name.c_str());
+        lock.unlock();
+        on_error_(id, "Too many tool calls in progress");
+        return;
+    }
+
+    auto tool_call = std::make_shared<McpToolCall>();
+    tool_call->id = id;
+    tool_call->name = name;
+    tool_call->call = std::move(call);
+    tool_call->deadline_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    active++;
+    queue_.push_back(std::move(tool_call));
+
+    if (!timeout_timer_running_) {
+        esp_timer_start_periodic(timeout_timer_, MCP_TOOL_TIMEOUT_CHECK_MS * 1000);
+        timeout_timer_running_ = true;
+    }
+    condition_.notify_one();
+}
+
+bool McpToolRunner::Cancel(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+        if ((*it)->id == id) {
+            ESP_LOGI(TAG, "Cancel queued call %d of %s", id, (*it)->name.c_str());
+            (*it)->cancelled = true;
+            (*it)->finished = true;
+            ReleaseCall((*it)->name);
+            queue_.erase(it);
+            return true;
+        }
+    }
+    for (auto& tool_call : running_) {
+        if (tool_call->id == id) {
+            ESP_LOGI(TAG, "Cancel running call %d of %s", id, tool_call->name.c_str());
+            tool_call->cancelled = true;
+            tool_call->finished = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool McpToolRunner::IsCancelled() {
+    return current_call != nullptr && current_call->cancelled;
+}
+
+void McpToolRunner::ReleaseCall(const std::string& name) {
+    auto it = active_calls_.find(name);
+    if (it != active_calls_.end() && --it->second <= 0) {
+        active_calls_.erase(it);
+    }
+}
+
+void McpToolRunner::WorkerTask() {
+    while (true) {
+        std::shared_ptr<McpToolCall> tool_call;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            condition_.wait(lock, [this]() { return !queue_.empty(); });
+            tool_call = queue_.front();
+            queue_.pop_front();
+            running_.push_back(tool_call);
+        }
+
+        int64_t start_time = esp_timer_get_time();
+        std::shared_ptr<TextSource> result;
+        std::string error;
+        current_call = tool_call.get();
+        try {
+            result = tool_call->call();
+        } catch (const std::exception& e) {
+            ESP_LOGE(TAG, "tools/call %s: %s", tool_call->name.c_str(), e.what());
+            error = e.what();
+        }
+        current_call = nullptr;
+        int elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+
+        if (!tool_call->finished.exchange(true)) {
+            ESP_LOGI(TAG, "Tool %s finished in %d ms, free stack %u bytes", tool_call->name.c_str(), elapsed_ms,
+                (unsigned)uxTaskGetStackHighWaterMark(NULL));
+            if (result) {
+                on_result_(tool_call->id, std::move(result));
+            } else {
+                on_error_(tool_call->id, error);
+            }
+        } else {
+            ESP_LOGW(TAG, "Discard result of %s after %d ms, call %d was cancelled or timed out",
+                tool_call->name.c_str(), elapsed_ms, tool_call->id);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_.erase(std::find(running_.begin(), running_.end(), tool_call));
+        ReleaseCall(tool_call->name);
+    }
+}
+
+void McpToolRunner::CheckTimeouts() {
+    std::vector<std::shared_ptr<McpToolCall>> expired;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int64_t now = esp_timer_get_time();
+        for (auto it = queue_.begin(); it != queue_.end();) {
+            if (now >= (*it)->deadline_us) {
+                ReleaseCall((*it)->name);
+                expired.push_back(std::move(*it));
+                it = queue_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto& tool_call : running_) {
+            if (now >= tool_call->deadline_us && !tool_call->finished) {
+                expired.push_back(tool_call);
+            }
+        }
+        for (auto& tool_call : expired) {
+            tool_call->cancelled = true;
+        }
+
+        if (queue_.empty() && running_.empty()) {
+            esp_timer_stop(timeout_timer_);
+            timeout_timer_running_ = false;
+        }
+    }
+
+    for (auto& tool_call : expired) {
+        if (!tool_call->finished.exchange(true)) {
+            ESP_LOGW(TAG, "Tool %s timed out, call %d", tool_call->name.c_str(), tool_call->id);
+            on_error_(tool_call->id, "Tool call timed out");
+        }
+    }
+}
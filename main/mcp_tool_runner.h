@@ -0,0 +1,82 @@
+#ifndef MCP_TOOL_RUNNER_H
+#define MCP_TOOL_RUNNER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "text_source.h"
+
+// Calls waiting for a free worker, more are rejected
+#define MCP_TOOL_MAX_QUEUED 4
+// Resolution of the timeout check
+#define MCP_TOOL_TIMEOUT_CHECK_MS 200
+
+struct McpToolCall {
+    int id;
+    std::string name;
+    std::function<std::shared_ptr<TextSource>()> call;
+    int64_t deadline_us;
+    std::atomic<bool> cancelled{false};
+    // Set by whoever replies first (the worker, the timeout or a cancellation)
+    std::atomic<bool> finished{false};
+};
+
+/*
+ * Runs blocking MCP tools (HTTP transfers, JPEG encoding, camera capture) on a small pool of
+ * worker tasks, so the main loop keeps handling state changes while they run.
+ *
+ * Every call gets exactly one reply: its result, an error, or nothing at all when the server
+ * cancelled it. A call past its timeout is answered with an error right away; the worker can not
+ * be interrupted, so the tool keeps its concurrency slot until the callback returns and its late
+ * result is discarded. Long running tools should poll IsCancelled() and give up early.
+ */
+class McpToolRunner {
+public:
+    using ResultHandler = std::function<void(int id, std::shared_ptr<TextSource> result)>;
+    using ErrorHandler = std::function<void(int id, const std::string& message)>;
+
+    McpToolRunner(ResultHandler on_result, ErrorHandler on_error);
+    ~McpToolRunner();
+    McpToolRunner(const McpToolRunner&) = delete;
+    McpToolRunner& operator=(const McpToolRunner&) = delete;
+
+    // Queues a call, at most max_concurrency calls of the same tool are queued or running
+    void Submit(int id, const std::string& name, int max_concurrency, int timeout_ms, std::function<std::shared_ptr<TextSource>()> call);
+    // Drops a queued call or discards the result of a running one, without replying
+    bool Cancel(int id);
+
+    // Whether the call running on the current worker was cancelled or timed out
+    static bool IsCancelled();
+
+private:
+    ResultHandler on_result_;
+    ErrorHandler on_error_;
+    std::vector<TaskHandle_t> workers_;
+    esp_timer_handle_t timeout_timer_ = nullptr;
+    bool timeout_timer_running_ = false;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::deque<std::shared_ptr<McpToolCall>> queue_;
+    std::vector<std::shared_ptr<McpToolCall>> running_;
+    // Queued plus running calls per tool name
+    std::map<std::string, int> active_calls_;
+
+    void StartWorkers();
+    void WorkerTask();
+    void CheckTimeouts();
+    void ReleaseCall(const std::string& name);
+};
+
+#endif // MCP_TOOL_RUNNER_H
@@ -0,0 +1,131 @@
+#include "audio_sender.h"
+
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "AudioSender"
+
+void AudioSender::Start(std::function<std::unique_ptr<AudioStreamPacket>()> pop, int deadline_ms) {
+    pop_ = std::move(pop);
+    deadline_ms_ = deadline_ms;
+
+    /* Just below the main loop, so state handling stays responsive while audio goes out promptly */
+    xTaskCreate([](void* arg) {
+        AudioSender* sender = (AudioSender*)arg;
+        sender->SenderTask();
+        vTaskDelete(NULL);
+    }, "audio_sender", 4096 * 2, this, 9, &task_handle_);
+}
+
+void AudioSender::SetProtocol(Protocol* protocol) {
+    std::lock_guard<std::mutex> lock(protocol_mutex_);
+    protocol_ = protocol;
+}
+
+void AudioSender::Notify() {
+    if (task_handle_ != nullptr) {
+        xTaskNotifyGive(task_handle_);
+    }
+}
+
+bool AudioSender::Send(std::unique_ptr<AudioStreamPacket> packet) {
+    std::lock_guard<std::mutex> lock(protocol_mutex_);
+    return Write(std::move(packet));
+}
+
+AudioSenderStatistics AudioSender::statistics() const {
+    std::lock_guard<std::mutex> lock(statistics_mutex_);
+    return statistics_;
+}
+
+void AudioSender::FillPending() {
+    while (pending_.size() < AUDIO_SENDER_MAX_PENDING) {
+        auto packet = pop_();
+        if (!packet) {
+            break;
+        }
+        pending_ms_ += packet->frame_duration;
+        pending_.push_back(std::move(packet));
+    }
+
+    /* The newest packet is current speech, everything beyond the deadline behind it is stale */
+    size_t stale = 0;
+    if (deadline_ms_ > 0) {
+        int remaining_ms = pending_ms_;
+        for (auto& packet : pending_) {
+            if (remaining_ms <= deadline_ms_) {
+                break;
+            }
+            remaining_ms -= packet->frame_duration;
+            stale++;
+        }
+    }
+    if (stale > 0) {
+        ESP_LOGW(TAG, "Uplink is %d ms behind, dropping %u packets", pending_ms_, stale);
+        DropPending(stale);
+    }
+}
+
+void AudioSender::DropPending(size_t count) {
+    count = std::min(count, pending_.size());
+    for (size_t i = 0; i < count; i++) {
+        pending_ms_ -= pending_.front()->frame_duration;
+        pending_.pop_front();
+    }
+    std::lock_guard<std::mutex> lock(statistics_mutex_);
+    statistics_.dropped += count;
+}
+
+bool AudioSender::Write(std::unique_ptr<AudioStreamPacket> packet) {
+    if (protocol_ == nullptr) {
+        return false;
+    }
+    int64_t start_time = esp_timer_get_time();
+    bool success = protocol_->SendAudio(std::move(packet));
+    uint32_t send_ms = (esp_timer_get_time() - start_time) / 1000;
+
+    std::lock_guard<std::mutex> lock(statistics_mutex_);
+    if (success) {
+        statistics_.sent++;
+    } else {
+        statistics_.failed++;
+    }
+    statistics_.max_send_ms = std::max(statistics_.max_send_ms, send_ms);
+    if (send_ms > AUDIO_SENDER_STALL_MS) {
+        statistics_.stalls++;
+        ESP_LOGW(TAG, "Audio write blocked for %lu ms (%lu stalls)", send_ms, statistics_.stalls);
+    }
+    return success;
+}
+
+void AudioSender::SenderTask() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        uint32_t batch = 0;
+        FillPending();
+        while (!pending_.empty()) {
+            auto packet = std::move(pending_.front());
+            pending_ms_ -= packet->frame_duration;
+            pending_.pop_front();
+
+            std::unique_lock<std::mutex> lock(protocol_mutex_);
+            bool success = Write(std::move(packet));
+            lock.unlock();
+            if (!success) {
+                /* The channel is gone or broken, the rest of this turn is not worth keeping */
+                DropPending(pending_.size());
+                break;
+            }
+            batch++;
+            /* Pick up what was encoded while the write blocked, and apply the deadline to it */
+            FillPending();
+        }
+
+        if (batch > 0) {
+            std::lock_guard<std::mutex> lock(statistics_mutex_);
+            statistics_.max_batch = std::max(statistics_.max_batch, batch);
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef AUDIO_SENDER_H
+#define AUDIO_SENDER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "protocol.h"
+
+// Packets taken from the send queue and not yet written, about 2.4 s of 60 ms frames
+#define AUDIO_SENDER_MAX_PENDING 40
+// A single write blocking longer than this counts as a stall
+#define AUDIO_SENDER_STALL_MS 100
+
+struct AudioSenderStatistics {
+    uint32_t sent = 0;
+    uint32_t failed = 0;
+    uint32_t dropped = 0;       // Older than the deadline, or behind a failed write
+    uint32_t stalls = 0;
+    uint32_t max_send_ms = 0;
+    uint32_t max_batch = 0;     // Most packets written in one wakeup
+};
+
+/*
+ * Writes the uplink audio to the protocol from its own task, so a blocking WebSocket / TLS
+ * write never holds up the main loop, and a busy main loop never delays the microphone.
+ *
+ * Each wakeup drains everything the encoder queued and writes it back to back. While the
+ * socket is backlogged, packets older than deadline_ms of audio are dropped from the front:
+ * late speech is worth less than current speech. A deadline of 0 keeps everything.
+ */
+class AudioSender {
+public:
+    AudioSender() = default;
+    AudioSender(const AudioSender&) = delete;
+    AudioSender& operator=(const AudioSender&) = delete;
+
+    // pop returns the next encoded packet, or nullptr when the queue is empty
+    void Start(std::function<std::unique_ptr<AudioStreamPacket>()> pop, int deadline_ms);
+    // Waits for a write in progress, so the old protocol can be destroyed afterwards
+    void SetProtocol(Protocol* protocol);
+    // Packets are waiting, may be called from any task
+    void Notify();
+    // Writes a packet from the calling task, in order with the sender task (wake word audio)
+    bool Send(std::unique_ptr<AudioStreamPacket> packet);
+
+    AudioSenderStatistics statistics() const;
+
+private:
+    std::function<std::unique_ptr<AudioStreamPacket>()> pop_;
+    int deadline_ms_ = 0;
+    TaskHandle_t task_handle_ = nullptr;
+    // Held while writing, the protocol is only replaced between writes
+    std::mutex protocol_mutex_;
+    Protocol* protocol_ = nullptr;
+
+    // Owned by the sender task
+    std::deque<std::unique_ptr<AudioStreamPacket>> pending_;
+    int pending_ms_ = 0;
+
+    mutable std::mutex statistics_mutex_;
+    AudioSenderStatistics statistics_;
+
+    void SenderTask();
+    void FillPending();
+    void DropPending(size_t count);
+    bool Write(std::unique_ptr<AudioStreamPacket> packet);
+};
+
+#endif // AUDIO_SENDER_H
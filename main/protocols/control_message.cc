@@ -0,0 +1,316 @@
+#include "control_message.h"
+
+#include <cstring>
+
+// Longest type / state / key name, longer strings can not match
+#define CONTROL_MESSAGE_MAX_NAME 16
+
+struct ControlName {
+    const char* name;
+    uint8_t length;
+    uint8_t value;
+};
+
+/*
+ * (2 * name[0] + name[1] + length) % 16 has no collisions for the names below,
+ * a lookup is one hash and one memcmp. Update the tables when adding a name.
+ */
+static inline uint32_t NameHash(const char* name, size_t length) {
+    return ((uint8_t)name[0] * 2 + (uint8_t)name[1] + length) & 15;
+}
+
+static const ControlName kTypeNames[16] = {
+    {"mcp", 3, kControlMessageMcp},             // 0
+    {"custom", 6, kControlMessageCustom},       // 1
+    {nullptr, 0, kControlMessageUnknown},
+    {"alert", 5, kControlMessageAlert},         // 3
+    {"goodbye", 7, kControlMessageGoodbye},     // 4
+    {"system", 6, kControlMessageSystem},       // 5
+    {nullptr, 0, kControlMessageUnknown},
+    {"llm", 3, kControlMessageLlm},             // 7
+    {nullptr, 0, kControlMessageUnknown},
+    {nullptr, 0, kControlMessageUnknown},
+    {"hello", 5, kControlMessageHello},         // 10
+    {nullptr, 0, kControlMessageUnknown},
+    {nullptr, 0, kControlMessageUnknown},
+    {"stt", 3, kControlMessageStt},             // 13
+    {nullptr, 0, kControlMessageUnknown},
+    {"tts", 3, kControlMessageTts},             // 15
+};
+
+static const ControlName kStateNames[16] = {
+    {nullptr, 0, kControlStateNone},
+    {nullptr, 0, kControlStateNone},
+    {nullptr, 0, kControlStateNone},
+    {nullptr, 0, kControlStateNone},
+    {nullptr, 0, kControlStateNone},
+    {nullptr, 0, kControlStateNone},
+    {nullptr, 0, kControlStateNone},
+    {"sentence_end", 12, kControlStateSentenceEnd},     // 7
+    {nullptr, 0, kControlStateNone},
+    {"sentence_start", 14, kControlStateSentenceStart}, // 9
+    {nullptr, 0, kControlStateNone},
+    {nullptr, 0, kControlStateNone},
+    {nullptr, 0, kControlStateNone},
+    {nullptr, 0, kControlStateNone},
+    {"stop", 4, kControlStateStop},                     // 14
+    {"start", 5, kControlStateStart},                   // 15
+};
+
+static uint8_t LookupName(const ControlName* table, const char* name, size_t length) {
+    if (length < 2) {
+        return 0;
+    }
+    auto& entry = table[NameHash(name, length)];
+    if (entry.name != nullptr && entry.length == length && memcmp(entry.name, name, length) == 0) {
+        return entry.value;
+    }
+    return 0;
+}
+
+// Cursor over a JSON text that is not NUL terminated
+class JsonReader {
+public:
+    JsonReader(const char* data, size_t length) : p_(data), end_(data + length) {}
+
+    bool Consume(char c) {
+        SkipWhitespace();
+        if (p_ < end_ && *p_ == c) {
+            p_++;
+            return true;
+        }
+        return false;
+    }
+
+    bool AtString() {
+        SkipWhitespace();
+        return p_ < end_ && *p_ == '"';
+    }
+
+    // Decodes a string into buffer, whole UTF-8 characters only, and sets truncated if it did not fit
+    bool ReadString(char* buffer, size_t size, size_t& length, bool& truncated) {
+        length = 0;
+        truncated = false;
+        if (!Consume('"')) {
+            return false;
+        }
+        while (p_ < end_) {
+            uint8_t c = *p_++;
+            if (c == '"') {
+                buffer[length] = '\0';
+                return true;
+            }
+            char character[4];
+            size_t character_length;
+            if (c == '\\') {
+                if (!ReadEscape(character, character_length)) {
+                    return false;
+                }
+            } else {
+                character_length = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+                if (end_ - p_ < (ptrdiff_t)character_length - 1) {
+                    return false;
+                }
+                character[0] = c;
+                memcpy(character + 1, p_, character_length - 1);
+                p_ += character_length - 1;
+            }
+            if (truncated || length + character_length >= size) {
+                truncated = true;
+                continue;
+            }
+            memcpy(buffer + length, character, character_length);
+            length += character_length;
+        }
+        return false;
+    }
+
+    bool SkipValue() {
+        SkipWhitespace();
+        if (p_ >= end_) {
+            return false;
+        }
+        if (*p_ == '"') {
+            return SkipString();
+        }
+        if (*p_ == '{' || *p_ == '[') {
+            int depth = 0;
+            while (p_ < end_) {
+                char c = *p_;
+                if (c == '"') {
+                    if (!SkipString()) {
+                        return false;
+                    }
+                    continue;
+                }
+                p_++;
+                if (c == '{' || c == '[') {
+                    depth++;
+                } else if ((c == '}' || c == ']') && --depth == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        // Number, true, false or null
+        auto start = p_;
+        while (p_ < end_ && *p_ != ',' && *p_ != '}' && *p_ != ']' && !IsWhitespace(*p_)) {
+            p_++;
+        }
+        return p_ > start;
+    }
+
+private:
+    const char* p_;
+    const char* end_;
+
+    static bool IsWhitespace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    void SkipWhitespace() {
+        while (p_ < end_ && IsWhitespace(*p_)) {
+            p_++;
+        }
+    }
+
+    bool SkipString() {
+        p_++;
+        while (p_ < end_) {
+            char c = *p_++;
+            if (c == '\\') {
+                p_++;
+            } else if (c == '"') {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool ReadHex4(uint32_t& value) {
+        if (end_ - p_ < 4) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = *p_++;
+            value <<= 4;
+            if (c >= '0' && c <= '9') {
+                value |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                value |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                value |= c - 'A' + 10;
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ReadEscape(char* character, size_t& length) {
+        if (p_ >= end_) {
+            return false;
+        }
+        length = 1;
+        char c = *p_++;
+        switch (c) {
+        case 'b': character[0] = '\b'; return true;
+        case 'f': character[0] = '\f'; return true;
+        case 'n': character[0] = '\n'; return true;
+        case 'r': character[0] = '\r'; return true;
+        case 't': character[0] = '\t'; return true;
+        case 'u': break;
+        default: character[0] = c; return true;
+        }
+
+        uint32_t code_point;
+        if (!ReadHex4(code_point)) {
+            return false;
+        }
+        /* Characters outside the BMP come as a surrogate pair */
+        if (code_point >= 0xD800 && code_point <= 0xDBFF && end_ - p_ >= 6 && p_[0] == '\\' && p_[1] == 'u') {
+            p_ += 2;
+            uint32_t low;
+            if (!ReadHex4(low) || low < 0xDC00 || low > 0xDFFF) {
+                return false;
+            }
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+        }
+        if (code_point < 0x80) {
+            character[0] = code_point;
+        } else if (code_point < 0x800) {
+            character[0] = 0xC0 | (code_point >> 6);
+            character[1] = 0x80 | (code_point & 0x3F);
+            length = 2;
+        } else if (code_point < 0x10000) {
+            character[0] = 0xE0 | (code_point >> 12);
+            character[1] = 0x80 | ((code_point >> 6) & 0x3F);
+            character[2] = 0x80 | (code_point & 0x3F);
+            length = 3;
+        } else {
+            character[0] = 0xF0 | (code_point >> 18);
+            character[1] = 0x80 | ((code_point >> 12) & 0x3F);
+            character[2] = 0x80 | ((code_point >> 6) & 0x3F);
+            character[3] = 0x80 | (code_point & 0x3F);
+            length = 4;
+        }
+        return true;
+    }
+};
+
+bool ControlMessageParser::Parse(const char* data, size_t length, ControlMessage& message) {
+    message.type = kControlMessageUnknown;
+    message.state = kControlStateNone;
+    message.has_text = false;
+    message.has_emotion = false;
+    message.text_truncated = false;
+    message.text[0] = '\0';
+    message.emotion[0] = '\0';
+
+    JsonReader reader(data, length);
+    if (!reader.Consume('{')) {
+        return false;
+    }
+    if (reader.Consume('}')) {
+        return true;
+    }
+    do {
+        char key[CONTROL_MESSAGE_MAX_NAME];
+        size_t key_length;
+        bool truncated;
+        if (!reader.ReadString(key, sizeof(key), key_length, truncated) || !reader.Consume(':')) {
+            return false;
+        }
+        if (truncated || !reader.AtString()) {
+            if (!reader.SkipValue()) {
+                return false;
+            }
+            continue;
+        }
+
+        bool ok = true;
+        char name[CONTROL_MESSAGE_MAX_NAME];
+        size_t name_length;
+        if (strcmp(key, "type") == 0) {
+            ok = reader.ReadString(name, sizeof(name), name_length, truncated);
+            message.type = truncated ? kControlMessageUnknown : (ControlMessageType)LookupName(kTypeNames, name, name_length);
+        } else if (strcmp(key, "state") == 0) {
+            ok = reader.ReadString(name, sizeof(name), name_length, truncated);
+            message.state = truncated ? kControlStateNone : (ControlMessageState)LookupName(kStateNames, name, name_length);
+        } else if (strcmp(key, "text") == 0) {
+            ok = reader.ReadString(message.text, sizeof(message.text), name_length, truncated);
+            message.has_text = true;
+            message.text_truncated = truncated;
+        } else if (strcmp(key, "emotion") == 0) {
+            ok = reader.ReadString(message.emotion, sizeof(message.emotion), name_length, truncated);
+            message.has_emotion = true;
+        } else {
+            ok = reader.SkipValue();
+        }
+        if (!ok) {
+            return false;
+        }
+    } while (reader.Consume(','));
+    return reader.Consume('}');
+}
@@ -0,0 +1,65 @@
+#ifndef CONTROL_MESSAGE_H
+#define CONTROL_MESSAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Fits almost every sentence, longer texts are read again with cJSON into long_text
+#define CONTROL_MESSAGE_MAX_TEXT 512
+#define CONTROL_MESSAGE_MAX_EMOTION 32
+
+enum ControlMessageType : uint8_t {
+    kControlMessageUnknown,
+    kControlMessageHello,
+    kControlMessageGoodbye,
+    kControlMessageTts,
+    kControlMessageStt,
+    kControlMessageLlm,
+    kControlMessageMcp,
+    kControlMessageSystem,
+    kControlMessageAlert,
+    kControlMessageCustom,
+};
+
+enum ControlMessageState : uint8_t {
+    kControlStateNone,
+    kControlStateStart,
+    kControlStateStop,
+    kControlStateSentenceStart,
+    kControlStateSentenceEnd,
+};
+
+// The fields of the streaming messages (tts, stt, llm), kept in fixed buffers
+struct ControlMessage {
+    ControlMessageType type = kControlMessageUnknown;
+    ControlMessageState state = kControlStateNone;
+    bool has_text = false;
+    bool has_emotion = false;
+    // text holds only the first CONTROL_MESSAGE_MAX_TEXT - 1 bytes, the whole text is in long_text
+    bool text_truncated = false;
+    char text[CONTROL_MESSAGE_MAX_TEXT];
+    char emotion[CONTROL_MESSAGE_MAX_EMOTION];
+    std::string long_text;
+
+    const char* full_text() const { return text_truncated ? long_text.c_str() : text; }
+};
+
+/*
+ * Single pass parser for the control channel JSON.
+ *
+ * It walks the top level object once without allocating, looks up type and state in perfect
+ * hash tables and copies only text and emotion. Nested values are skipped, so messages with a
+ * structured payload (hello, mcp, alert...) still need cJSON.
+ */
+class ControlMessageParser {
+public:
+    // Returns false when the data is not a JSON object
+    static bool Parse(const char* data, size_t length, ControlMessage& message);
+    // tts, stt and llm carry everything the application needs in ControlMessage
+    static bool IsStreamingMessage(ControlMessageType type) {
+        return type == kControlMessageTts || type == kControlMessageStt || type == kControlMessageLlm;
+    }
+};
+
+#endif // CONTROL_MESSAGE_H
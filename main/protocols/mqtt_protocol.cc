@@ -2,6 +2,7 @@
 #include "board.h"
 #include "application.h"
 #include "settings.h"
+#include "latency_tracer.h"
 
 #include <esp_log.h>
 #include <cstring>
@@ -25,7 +26,7 @@ MqttProtocol::MqttProtocol() {
                     if (*alive) {
                         protocol->StartMqttClient(false);
                     }
-                });
+                }, kMainTaskBackground, "mqtt_reconnect");
             }
         },
         .arg = this,
@@ -98,6 +99,10 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
+        if (DispatchControlMessage(payload.data(), payload.size())) {
+            last_incoming_time_ = std::chrono::steady_clock::now();
+            return;
+        }
         cJSON* root = cJSON_Parse(payload.c_str());
         if (root == nullptr) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
@@ -122,7 +127,7 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
                         // Server initiated goodbye, don't send goodbye back to avoid ping-pong
                         CloseAudioChannel(false);
                     }
-                });
+                }, kMainTaskState, "mqtt_goodbye");
             }
         } else if (on_incoming_json_ != nullptr) {
             on_incoming_json_(root);
@@ -169,30 +174,36 @@ bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
         return false;
     }
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
+    /* The nonce goes into the packet's headroom and the Opus data is encrypted in place */
+    size_t opus_size = packet->opus_size();
+    auto nonce = packet->ClaimHeader(aes_nonce_.size());
+    memcpy(nonce, aes_nonce_.data(), aes_nonce_.size());
+    *(uint16_t*)&nonce[2] = htons(opus_size);
     *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
     *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
 
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
-
+    // mbedtls advances the counter block, keep the nonce in the packet intact
+    uint8_t counter[16];
+    memcpy(counter, nonce, sizeof(counter));
     size_t nc_off = 0;
     uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+    if (mbedtls_aes_crypt_ctr(&aes_ctx_, opus_size, &nc_off, counter, stream_block,
+        packet->opus_data(), packet->opus_data()) != 0) {
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return false;
     }
 
-    return udp_->Send(encrypted) > 0;
+    // Udp::Send takes a string, reuse one so its capacity survives between packets
+    datagram_.assign((const char*)nonce, aes_nonce_.size() + opus_size);
+    return udp_->Send(datagram_) > 0;
 }
 
 void MqttProtocol::CloseAudioChannel(bool send_goodbye) {
+    bool parked = channel_parked_;
     {
         std::lock_guard<std::mutex> lock(channel_mutex_);
         udp_.reset();
+        channel_parked_ = false;
     }
 
     ESP_LOGI(TAG, "Closing audio channel, send_goodbye: %d", send_goodbye);
@@ -207,12 +218,24 @@ void MqttProtocol::CloseAudioChannel(bool send_goodbye) {
         SendText(message);
     }
 
-    if (on_audio_channel_closed_ != nullptr) {
+    // The application already went idle when the channel was parked
+    if (!parked && on_audio_channel_closed_ != nullptr) {
         on_audio_channel_closed_();
     }
 }
 
+void MqttProtocol::DropParkedChannel() {
+    // Let the server free the session unless the broker connection is already gone
+    CloseAudioChannel(mqtt_ != nullptr && mqtt_->IsConnected());
+}
+
 bool MqttProtocol::OpenAudioChannel() {
+    if (channel_parked_ && mqtt_ != nullptr && mqtt_->IsConnected() &&
+        ResumeParkedChannel(Application::GetInstance().GetAudioService().encoder_frame_duration())) {
+        return true;
+    }
+    ReleaseParkedChannel(true);
+
     if (mqtt_ == nullptr || !mqtt_->IsConnected()) {
         ESP_LOGI(TAG, "MQTT is not connected, try to connect now");
         if (!StartMqttClient(true)) {
@@ -225,6 +248,7 @@ bool MqttProtocol::OpenAudioChannel() {
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 
     auto message = GetHelloMessage();
+    auto hello_time = esp_timer_get_time();
     if (!SendText(message)) {
         return false;
     }
@@ -236,17 +260,22 @@ bool MqttProtocol::OpenAudioChannel() {
         SetError(Lang::Strings::SERVER_TIMEOUT);
         return false;
     }
+    /* The hello round trip is the link quality input for the next session's encoder settings */
+    Application::GetInstance().GetAudioService().ReportNetworkRtt((esp_timer_get_time() - hello_time) / 1000);
 
     std::lock_guard<std::mutex> lock(channel_mutex_);
     auto network = Board::GetInstance().GetNetwork();
     udp_ = network->CreateUdp(2);
     udp_->OnMessage([this](const std::string& data) {
+        if (channel_parked_) {
+            return;
+        }
         /*
          * UDP Encrypted OPUS Packet Format:
          * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
          * |payload payload_len|
          */
-        if (data.size() < sizeof(aes_nonce_)) {
+        if (data.size() < aes_nonce_.size()) {
             ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
             return;
         }
@@ -256,25 +285,25 @@ bool MqttProtocol::OpenAudioChannel() {
         }
         uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
         uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
+        /* Reordered and missing packets are handled by the jitter buffer in AudioService */
         if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+            ESP_LOGD(TAG, "Received audio packet with sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
         }
 
         size_t decrypted_size = data.size() - aes_nonce_.size();
         size_t nc_off = 0;
         uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
+        // mbedtls advances the counter block, don't let it write into the received buffer
+        uint8_t counter[16];
+        memcpy(counter, data.data(), sizeof(counter));
+        auto encrypted = (const uint8_t*)data.data() + aes_nonce_.size();
         auto packet = std::make_unique<AudioStreamPacket>();
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
         packet->timestamp = timestamp;
+        packet->sequence = sequence;
         packet->payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
+        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, counter, stream_block, encrypted, packet->payload.data());
         if (ret != 0) {
             ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
             return;
@@ -282,7 +311,9 @@ bool MqttProtocol::OpenAudioChannel() {
         if (on_incoming_audio_ != nullptr) {
             on_incoming_audio_(std::move(packet));
         }
-        remote_sequence_ = sequence;
+        if (sequence > remote_sequence_) {
+            remote_sequence_ = sequence;
+        }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -310,7 +341,8 @@ std::string MqttProtocol::GetHelloMessage() {
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    session_frame_duration_ = Application::GetInstance().GetAudioService().encoder_frame_duration();
+    cJSON_AddNumberToObject(audio_params, "frame_duration", session_frame_duration_);
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -320,6 +352,7 @@ std::string MqttProtocol::GetHelloMessage() {
 }
 
 void MqttProtocol::ParseServerHello(const cJSON* root) {
+    LatencyTracer::GetInstance().Record(kLatencyServerHello);
     auto transport = cJSON_GetObjectItem(root, "transport");
     if (transport == nullptr || strcmp(transport->valuestring, "udp") != 0) {
         ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
@@ -358,6 +391,10 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
     // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
     aes_nonce_ = DecodeHexString(nonce);
+    if (aes_nonce_.size() != MQTT_AUDIO_NONCE_SIZE) {
+        ESP_LOGE(TAG, "Invalid UDP nonce size: %u", aes_nonce_.size());
+        return;
+    }
     mbedtls_aes_init(&aes_ctx_);
     mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
     local_sequence_ = 0;
@@ -385,5 +422,5 @@ std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
 }
 
 bool MqttProtocol::IsAudioChannelOpened() const {
-    return udp_ != nullptr && !error_occurred_ && !IsTimeout();
+    return udp_ != nullptr && !channel_parked_ && !error_occurred_ && !IsTimeout();
 }
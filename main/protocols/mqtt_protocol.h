@@ -23,6 +23,10 @@
 
 #define MQTT_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
+// AES-CTR nonce sent in front of every UDP audio packet, it is written into the packet headroom
+#define MQTT_AUDIO_NONCE_SIZE 16
+static_assert(AUDIO_PACKET_HEADROOM >= MQTT_AUDIO_NONCE_SIZE, "Audio packet headroom can not hold the UDP nonce");
+
 class MqttProtocol : public Protocol {
 public:
     MqttProtocol();
@@ -51,6 +55,7 @@ private:
     int udp_port_;
     uint32_t local_sequence_;
     uint32_t remote_sequence_;
+    std::string datagram_;
     esp_timer_handle_t reconnect_timer_;
 
     bool StartMqttClient(bool report_error=false);
@@ -58,6 +63,7 @@ private:
     std::string DecodeHexString(const std::string& hex_string);
 
     bool SendText(const std::string& text) override;
+    void DropParkedChannel() override;
     std::string GetHelloMessage();
 };
 
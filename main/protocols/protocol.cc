@@ -1,4 +1,5 @@
 #include "protocol.h"
+#include "latency_tracer.h"
 
 #include <esp_log.h>
 
@@ -8,6 +9,10 @@ void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
     on_incoming_json_ = callback;
 }
 
+void Protocol::OnIncomingControl(std::function<void(const ControlMessage& message)> callback) {
+    on_incoming_control_ = callback;
+}
+
 void Protocol::OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback) {
     on_incoming_audio_ = callback;
 }
@@ -55,6 +60,7 @@ void Protocol::SendWakeWordDetected(const std::string& wake_word) {
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
+    LatencyTracer::GetInstance().Record(kLatencyListenStart);
     std::string message = "{\"session_id\":\"" + session_id_ + "\"";
     message += ",\"type\":\"listen\",\"state\":\"start\"";
     if (mode == kListeningModeRealtime) {
@@ -69,6 +75,11 @@ void Protocol::SendStartListening(ListeningMode mode) {
 }
 
 void Protocol::SendStopListening() {
+    LatencyTracer::GetInstance().Record(kLatencyVoiceEnd);
+    SendListenStop();
+}
+
+void Protocol::SendListenStop() {
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
     SendText(message);
 }
@@ -78,6 +89,50 @@ void Protocol::SendMcpMessage(const std::string& payload) {
     SendText(message);
 }
 
+void Protocol::SendMcpMessage(std::shared_ptr<TextSource> payload) {
+    WrappedTextSource message("{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":", std::move(payload), "}");
+    SendTextStream(message);
+}
+
+bool Protocol::SendTextStream(TextSource& text) {
+    std::string message(text.length(), '\0');
+    size_t offset = 0;
+    while (offset < message.size()) {
+        size_t n = text.Read(&message[offset], message.size() - offset);
+        // A source must produce exactly length() bytes
+        if (n == 0) {
+            ESP_LOGE(TAG, "Text stream ended %u bytes early", message.size() - offset);
+            return false;
+        }
+        offset += n;
+    }
+    return SendText(message);
+}
+
+bool Protocol::DispatchControlMessage(const char* data, size_t length) {
+    if (on_incoming_control_ == nullptr || !ControlMessageParser::Parse(data, length, control_message_) ||
+        !ControlMessageParser::IsStreamingMessage(control_message_.type)) {
+        return false;
+    }
+    if (channel_parked_) {
+        // Late messages of the reply aborted when parking, the application is idle
+        return true;
+    }
+    if (control_message_.text_truncated) {
+        /* Rare, a text longer than the fixed buffer is read again in full */
+        auto root = cJSON_ParseWithLength(data, length);
+        auto text = cJSON_GetObjectItem(root, "text");
+        if (cJSON_IsString(text)) {
+            control_message_.long_text = text->valuestring;
+        } else {
+            control_message_.text_truncated = false;
+        }
+        cJSON_Delete(root);
+    }
+    on_incoming_control_(control_message_);
+    return true;
+}
+
 bool Protocol::IsTimeout() const {
     const int kTimeoutSeconds = 120;
     auto now = std::chrono::steady_clock::now();
@@ -88,3 +143,60 @@ bool Protocol::IsTimeout() const {
     }
     return timeout;
 }
+
+void Protocol::ParkAudioChannel() {
+#if CONFIG_USE_WARM_AUDIO_CHANNEL
+    if (IsAudioChannelOpened()) {
+        ESP_LOGI(TAG, "Parking audio channel, session_id: %s", session_id_.c_str());
+        /* The server keeps the session, make sure it stops listening and drops the reply in progress.
+           This is not the end of a user turn, so it bypasses the latency trace of SendStopListening */
+        SendListenStop();
+        SendAbortSpeaking(kAbortReasonNone);
+        channel_parked_ = true;
+        parked_time_ = std::chrono::steady_clock::now();
+        if (on_audio_channel_closed_ != nullptr) {
+            on_audio_channel_closed_();
+        }
+        return;
+    }
+#endif
+    CloseAudioChannel();
+}
+
+void Protocol::ReleaseParkedChannel(bool force) {
+    if (!channel_parked_) {
+        return;
+    }
+#if CONFIG_USE_WARM_AUDIO_CHANNEL
+    auto idle = std::chrono::steady_clock::now() - parked_time_;
+    if (!force && idle < std::chrono::seconds(CONFIG_WARM_AUDIO_CHANNEL_IDLE_SECONDS)) {
+        return;
+    }
+#endif
+    ESP_LOGI(TAG, "Releasing parked audio channel");
+    DropParkedChannel();
+}
+
+bool Protocol::ResumeParkedChannel(int frame_duration) {
+    if (!channel_parked_) {
+        return false;
+    }
+#if CONFIG_USE_WARM_AUDIO_CHANNEL
+    auto idle = std::chrono::steady_clock::now() - parked_time_;
+    /* The server decodes with the frame duration of the hello, a new one needs a new session */
+    if (idle < std::chrono::seconds(CONFIG_WARM_AUDIO_CHANNEL_IDLE_SECONDS) && frame_duration == session_frame_duration_) {
+        channel_parked_ = false;
+        if (IsAudioChannelOpened()) {
+            ESP_LOGI(TAG, "Resumed parked audio channel, session_id: %s", session_id_.c_str());
+            if (on_audio_channel_opened_ != nullptr) {
+                on_audio_channel_opened_();
+            }
+            return true;
+        }
+        channel_parked_ = true;
+    }
+#endif
+    ESP_LOGI(TAG, "Parked audio channel can not be resumed, opening a new session");
+    DropParkedChannel();
+    return false;
+}
@@ -2,16 +2,67 @@
 #define PROTOCOL_H
 
 #include <cJSON.h>
+#include <atomic>
 #include <string>
 #include <functional>
 #include <chrono>
 #include <vector>
 
+#include "audio_frame_pool.h"
+#include "control_message.h"
+#include "text_source.h"
+
+// Largest transport header (BinaryProtocol2, MQTT UDP nonce) put in front of an outgoing packet
+#define AUDIO_PACKET_HEADROOM 16
+
+// Packets and their payload buffers are recycled through AudioFramePool
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
-    std::vector<uint8_t> payload;
+    // Transport sequence number for reordering, 0 when the transport is already ordered
+    uint32_t sequence = 0;
+    // Bytes at the front of payload kept free for a transport header, the Opus data follows them
+    uint16_t headroom = 0;
+    std::vector<uint8_t> payload = AudioFramePool::GetInstance().AcquireOpus();
+    // Read-only Opus data outside payload (built-in sounds in flash), copied on the first write
+    const uint8_t* external_data = nullptr;
+    size_t external_size = 0;
+
+    uint8_t* opus_data() { Detach(); return payload.data() + headroom; }
+    const uint8_t* opus_data() const { return external_data != nullptr ? external_data : payload.data() + headroom; }
+    size_t opus_size() const { return external_data != nullptr ? external_size : payload.size() - headroom; }
+    void ResizeOpus(size_t size) { Detach(); payload.resize(headroom + size); }
+
+    // Points the packet at data that outlives it instead of copying it
+    void Reference(const uint8_t* data, size_t size) {
+        external_data = data;
+        external_size = size;
+    }
+
+    void Detach() {
+        if (external_data != nullptr) {
+            payload.resize(headroom);
+            payload.insert(payload.end(), external_data, external_data + external_size);
+            external_data = nullptr;
+        }
+    }
+
+    // Returns the header_size bytes right in front of the Opus data, so header and data go out in one buffer
+    uint8_t* ClaimHeader(size_t header_size) {
+        Detach();
+        if (headroom < header_size) {
+            // Packets built without headroom (wake word, assets) pay one memmove here
+            payload.insert(payload.begin(), header_size - headroom, 0);
+            headroom = header_size;
+        }
+        return opus_data() - header_size;
+    }
+
+    ~AudioStreamPacket() { AudioFramePool::GetInstance().ReleaseOpus(std::move(payload)); }
+
+    static void* operator new(size_t size) { return AudioFramePool::GetInstance().AllocatePacket(size); }
+    static void operator delete(void* ptr) { AudioFramePool::GetInstance().FreePacket(ptr); }
 };
 
 struct BinaryProtocol2 {
@@ -57,6 +108,8 @@ public:
 
     void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
     void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    // tts, stt and llm messages, parsed without cJSON; all other messages go to OnIncomingJson
+    void OnIncomingControl(std::function<void(const ControlMessage& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
@@ -67,15 +120,22 @@ public:
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel(bool send_goodbye = true) = 0;
     virtual bool IsAudioChannelOpened() const = 0;
+    // Ends the conversation but keeps the transport and session for the next one (warm channel mode)
+    virtual void ParkAudioChannel();
+    // Closes a parked channel once it has been idle too long, or right away when forced
+    void ReleaseParkedChannel(bool force = false);
     virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
     virtual void SendAbortSpeaking(AbortReason reason);
     virtual void SendMcpMessage(const std::string& message);
+    // Large payloads (image results) go out in chunks, see SendTextStream
+    void SendMcpMessage(std::shared_ptr<TextSource> payload);
 
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
+    std::function<void(const ControlMessage& message)> on_incoming_control_;
     std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
@@ -88,10 +148,27 @@ protected:
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    // Only touched by the transport's receive callback
+    ControlMessage control_message_;
+    // Written by the main task and the transport's receive and disconnect callbacks
+    std::atomic<bool> channel_parked_{false};
+    std::chrono::time_point<std::chrono::steady_clock> parked_time_;
+    // Encoder frame duration announced in the hello of the current session
+    int session_frame_duration_ = 0;
 
     virtual bool SendText(const std::string& text) = 0;
+    // Transports that can send a text message in fragments override this, the default builds it in memory
+    virtual bool SendTextStream(TextSource& text);
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    // Returns false when the message needs the cJSON path, streaming messages are dropped while parked
+    bool DispatchControlMessage(const char* data, size_t length);
+    // The listen stop message without marking the end of a user turn
+    void SendListenStop();
+    // Reopens a parked channel without a hello, false if a new session is needed
+    bool ResumeParkedChannel(int frame_duration);
+    // Tears down the parked transport without notifying the application
+    virtual void DropParkedChannel() { channel_parked_ = false; }
 };
 
 #endif // PROTOCOL_H
@@ -0,0 +1,85 @@
+#ifndef TEXT_SOURCE_H
+#define TEXT_SOURCE_H
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+
+/*
+ * A text message produced piece by piece, so large payloads (base64 images) can be sent in
+ * fixed-size chunks without ever existing in memory as one string.
+ */
+class TextSource {
+public:
+    virtual ~TextSource() = default;
+    // Total length in bytes, known before the first Read
+    virtual size_t length() const = 0;
+    // Copies the next bytes to buffer, returns 0 once everything was read
+    virtual size_t Read(char* buffer, size_t size) = 0;
+};
+
+class StringTextSource : public TextSource {
+public:
+    explicit StringTextSource(std::string text) : text_(std::move(text)) {}
+
+    size_t length() const override { return text_.size(); }
+
+    size_t Read(char* buffer, size_t size) override {
+        size_t n = std::min(size, text_.size() - offset_);
+        memcpy(buffer, text_.data() + offset_, n);
+        offset_ += n;
+        return n;
+    }
+
+private:
+    std::string text_;
+    size_t offset_ = 0;
+};
+
+// prefix + body + suffix, each protocol layer adds its envelope around the payload this way
+class WrappedTextSource : public TextSource {
+public:
+    WrappedTextSource(std::string prefix, std::shared_ptr<TextSource> body, std::string suffix)
+        : prefix_(std::move(prefix)), body_(std::move(body)), suffix_(std::move(suffix)) {}
+
+    size_t length() const override { return prefix_.size() + body_->length() + suffix_.size(); }
+
+    size_t Read(char* buffer, size_t size) override {
+        size_t total = 0;
+        while (total < size) {
+            size_t n;
+            if (offset_ < prefix_.size()) {
+                n = std::min(size - total, prefix_.size() - offset_);
+                memcpy(buffer + total, prefix_.data() + offset_, n);
+            } else if (!body_done_) {
+                n = body_->Read(buffer + total, size - total);
+                if (n == 0) {
+                    body_done_ = true;
+                    suffix_start_ = offset_;
+                    continue;
+                }
+            } else {
+                size_t suffix_offset = offset_ - suffix_start_;
+                n = std::min(size - total, suffix_.size() - suffix_offset);
+                if (n == 0) {
+                    break;
+                }
+                memcpy(buffer + total, suffix_.data() + suffix_offset, n);
+            }
+            offset_ += n;
+            total += n;
+        }
+        return total;
+    }
+
+private:
+    std::string prefix_;
+    std::shared_ptr<TextSource> body_;
+    std::string suffix_;
+    size_t offset_ = 0;
+    size_t suffix_start_ = 0;
+    bool body_done_ = false;
+};
+
+#endif // TEXT_SOURCE_H
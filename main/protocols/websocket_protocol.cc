@@ -3,6 +3,7 @@
 #include "system_info.h"
 #include "application.h"
 #include "settings.h"
+#include "latency_tracer.h"
 
 #include <cstring>
 #include <cJSON.h>
@@ -26,34 +27,30 @@ bool WebsocketProtocol::Start() {
 }
 
 bool WebsocketProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+    /* Audio is written from the sender task, the channel may be closed from the main task meanwhile */
+    std::lock_guard<std::mutex> lock(channel_mutex_);
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
 
+    /* The header goes into the packet's headroom, header and Opus data are sent as one buffer */
+    size_t opus_size = packet->opus_size();
     if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
+        auto bp2 = (BinaryProtocol2*)packet->ClaimHeader(sizeof(BinaryProtocol2));
         bp2->version = htons(version_);
         bp2->type = 0;
         bp2->reserved = 0;
         bp2->timestamp = htonl(packet->timestamp);
-        bp2->payload_size = htonl(packet->payload.size());
-        memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        bp2->payload_size = htonl(opus_size);
+        return websocket_->Send((const char*)bp2, sizeof(BinaryProtocol2) + opus_size, true);
     } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
+        auto bp3 = (BinaryProtocol3*)packet->ClaimHeader(sizeof(BinaryProtocol3));
         bp3->type = 0;
         bp3->reserved = 0;
-        bp3->payload_size = htons(packet->payload.size());
-        memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        bp3->payload_size = htons(opus_size);
+        return websocket_->Send((const char*)bp3, sizeof(BinaryProtocol3) + opus_size, true);
     } else {
-        return websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+        return websocket_->Send((const char*)packet->opus_data(), opus_size, true);
     }
 }
 
@@ -71,16 +68,59 @@ bool WebsocketProtocol::SendText(const std::string& text) {
     return true;
 }
 
+bool WebsocketProtocol::SendTextStream(TextSource& text) {
+    /* Frames of other messages may not come between the fragments, so audio waits for the whole message */
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+
+    auto buffer = std::make_unique<char[]>(WEBSOCKET_TEXT_CHUNK_SIZE);
+    size_t remaining = text.length();
+    while (remaining > 0) {
+        size_t n = text.Read(buffer.get(), std::min<size_t>(WEBSOCKET_TEXT_CHUNK_SIZE, remaining));
+        // A source must produce exactly length() bytes
+        if (n == 0) {
+            /* Finishing the message would hand truncated JSON to the server, drop the connection instead */
+            ESP_LOGE(TAG, "Text stream ended %u bytes early", remaining);
+            websocket_.reset();
+            SetError(Lang::Strings::SERVER_ERROR);
+            return false;
+        }
+        remaining -= n;
+        // The first fragment is a text frame, the following ones are continuation frames
+        if (!websocket_->Send(buffer.get(), n, false, remaining == 0)) {
+            ESP_LOGE(TAG, "Failed to send text stream, %u bytes left", remaining);
+            SetError(Lang::Strings::SERVER_ERROR);
+            return false;
+        }
+    }
+    return true;
+}
+
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    return websocket_ != nullptr && websocket_->IsConnected() && !channel_parked_ && !error_occurred_ && !IsTimeout();
 }
 
 void WebsocketProtocol::CloseAudioChannel(bool send_goodbye) {
     (void)send_goodbye;  // Websocket doesn't need to send goodbye message
+    std::lock_guard<std::mutex> lock(channel_mutex_);
     websocket_.reset();
+    channel_parked_ = false;
+}
+
+void WebsocketProtocol::DropParkedChannel() {
+    // The application already went idle when the channel was parked
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    websocket_.reset();
+    channel_parked_ = false;
 }
 
 bool WebsocketProtocol::OpenAudioChannel() {
+    if (ResumeParkedChannel(Application::GetInstance().GetAudioService().encoder_frame_duration())) {
+        return true;
+    }
+
     Settings settings("websocket", false);
     std::string url = settings.GetString("url");
     std::string token = settings.GetString("token");
@@ -92,7 +132,10 @@ bool WebsocketProtocol::OpenAudioChannel() {
     error_occurred_ = false;
 
     auto network = Board::GetInstance().GetNetwork();
-    websocket_ = network->CreateWebSocket(1);
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        websocket_ = network->CreateWebSocket(1);
+    }
     if (websocket_ == nullptr) {
         ESP_LOGE(TAG, "Failed to create websocket");
         return false;
@@ -111,41 +154,42 @@ bool WebsocketProtocol::OpenAudioChannel() {
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
         if (binary) {
-            if (on_incoming_audio_ != nullptr) {
+            // Late audio of the reply aborted when parking is dropped, the application is idle
+            if (on_incoming_audio_ != nullptr && !channel_parked_) {
+                /* Headers are read without touching the websocket buffer, only the Opus data is copied */
+                auto payload = (const uint8_t*)data;
+                size_t payload_size = len;
+                uint32_t timestamp = 0;
                 if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    }));
+                    if (len < sizeof(BinaryProtocol2)) {
+                        ESP_LOGE(TAG, "Invalid audio packet size: %u", len);
+                        return;
+                    }
+                    auto bp2 = (const BinaryProtocol2*)data;
+                    timestamp = ntohl(bp2->timestamp);
+                    payload = bp2->payload;
+                    payload_size = ntohl(bp2->payload_size);
                 } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    }));
-                } else {
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    }));
+                    if (len < sizeof(BinaryProtocol3)) {
+                        ESP_LOGE(TAG, "Invalid audio packet size: %u", len);
+                        return;
+                    }
+                    auto bp3 = (const BinaryProtocol3*)data;
+                    payload = bp3->payload;
+                    payload_size = ntohs(bp3->payload_size);
                 }
+                if (payload_size > len - (payload - (const uint8_t*)data)) {
+                    ESP_LOGE(TAG, "Audio payload size %u exceeds packet size %u", payload_size, len);
+                    return;
+                }
+                auto packet = std::make_unique<AudioStreamPacket>();
+                packet->sample_rate = server_sample_rate_;
+                packet->frame_duration = server_frame_duration_;
+                packet->timestamp = timestamp;
+                packet->payload.assign(payload, payload + payload_size);
+                on_incoming_audio_(std::move(packet));
             }
-        } else {
+        } else if (!DispatchControlMessage(data, len)) {
             // Parse JSON data
             auto root = cJSON_Parse(data);
             auto type = cJSON_GetObjectItem(root, "type");
@@ -167,6 +211,11 @@ bool WebsocketProtocol::OpenAudioChannel() {
 
     websocket_->OnDisconnected([this]() {
         ESP_LOGI(TAG, "Websocket disconnected");
+        if (channel_parked_) {
+            // Closed by the server while parked, the application is already idle
+            channel_parked_ = false;
+            return;
+        }
         if (on_audio_channel_closed_ != nullptr) {
             on_audio_channel_closed_();
         }
@@ -181,6 +230,7 @@ bool WebsocketProtocol::OpenAudioChannel() {
 
     // Send hello message to describe the client
     auto message = GetHelloMessage();
+    auto hello_time = esp_timer_get_time();
     if (!SendText(message)) {
         return false;
     }
@@ -192,6 +242,8 @@ bool WebsocketProtocol::OpenAudioChannel() {
         SetError(Lang::Strings::SERVER_TIMEOUT);
         return false;
     }
+    /* The hello round trip is the link quality input for the next session's encoder settings */
+    Application::GetInstance().GetAudioService().ReportNetworkRtt((esp_timer_get_time() - hello_time) / 1000);
 
     if (on_audio_channel_opened_ != nullptr) {
         on_audio_channel_opened_();
@@ -216,7 +268,8 @@ std::string WebsocketProtocol::GetHelloMessage() {
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    session_frame_duration_ = Application::GetInstance().GetAudioService().encoder_frame_duration();
+    cJSON_AddNumberToObject(audio_params, "frame_duration", session_frame_duration_);
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -226,6 +279,7 @@ std::string WebsocketProtocol::GetHelloMessage() {
 }
 
 void WebsocketProtocol::ParseServerHello(const cJSON* root) {
+    LatencyTracer::GetInstance().Record(kLatencyServerHello);
     auto transport = cJSON_GetObjectItem(root, "transport");
     if (transport == nullptr || strcmp(transport->valuestring, "websocket") != 0) {
         ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
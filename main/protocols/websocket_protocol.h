@@ -5,10 +5,13 @@
 #include "protocol.h"
 
 #include <web_socket.h>
+#include <mutex>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+// Fragment size of streamed text messages
+#define WEBSOCKET_TEXT_CHUNK_SIZE 2048
 
 class WebsocketProtocol : public Protocol {
 public:
@@ -23,11 +26,20 @@ public:
 
 private:
     EventGroupHandle_t event_group_handle_;
+    // Guards websocket_ against SendAudio from the audio sender task
+    std::mutex channel_mutex_;
     std::unique_ptr<WebSocket> websocket_;
     int version_ = 1;
 
     void ParseServerHello(const cJSON* root);
     bool SendText(const std::string& text) override;
+    /*
+     * Holds channel_mutex_ until the last fragment is out, since no other frame may come between
+     * them. A 100 KB image result blocks SendAudio for a few hundred milliseconds; the audio sender
+     * drops its oldest packets meanwhile, which is accepted to avoid holding the message in memory.
+     */
+    bool SendTextStream(TextSource& text) override;
+    void DropParkedChannel() override;
     std::string GetHelloMessage();
 };
 